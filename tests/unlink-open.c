@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../vsfs.h"
+#include "../vsfs-errors.h"
+
+/*
+  A file unlinked while open stays readable and writable through its
+  descriptor, and its blocks are freed when the descriptor is closed.
+*/
+
+#define IMAGE "unlink-open.img"
+#define CHUNK (64 * 1024)
+#define NCHUNKS 32
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+int main(void) {
+    static char buf[CHUNK], back[CHUNK];
+    struct vs_mkfs_opts opts = {.block_size = 4096};
+    struct vsfs *fs;
+    struct vs_statfs before, after;
+    struct vs_fsck_report r;
+
+    CHECK(vs_mkfs_ex(IMAGE, 16 * 1024 * 1024, &opts) == 0);
+    CHECK(vs_mount(IMAGE, &fs) == 0);
+    CHECK(vs_statfs(fs, &before) == 0);
+
+    CHECK(vs_create(fs, "f2") == 0);
+    int fd = vs_open(fs, "f2");
+    CHECK(fd >= 0);
+    CHECK(vs_unlink(fs, "f2") == 0);
+    CHECK(vs_open(fs, "f2") == -NOTEXIST_ERR);
+
+    for (int i = 0; i < NCHUNKS; i++) {
+        memset(buf, 'a' + i % 26, CHUNK);
+        CHECK(vs_write(fs, fd, i * CHUNK, CHUNK, buf) == CHUNK);
+    }
+    for (int i = 0; i < NCHUNKS; i++) {
+        memset(buf, 'a' + i % 26, CHUNK);
+        CHECK(vs_read(fs, fd, i * CHUNK, CHUNK, back) == CHUNK);
+        CHECK(memcmp(buf, back, CHUNK) == 0);
+    }
+    CHECK(vs_close(fs, fd) == 0);
+
+    CHECK(vs_sync(fs) == 0);
+    CHECK(vs_statfs(fs, &after) == 0);
+    CHECK(after.blocks_free == before.blocks_free);
+    CHECK(after.files_free == before.files_free);
+    CHECK(vs_umount(fs) == 0);
+
+    CHECK(vs_fsck(IMAGE, 0, 1, &r) == 0);
+    CHECK(r.files == 0 && r.blocks_used == 0 && r.leaked_blocks == 0 && r.lost_blocks == 0);
+
+    remove(IMAGE);
+    printf("unlink-open: OK\n");
+    return 0;
+}
@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "vsfs.h"
+#include "vsfs-errors.h"
+
+/*
+  Benchmark of VSFS calls. Creates an image with vs_mkfs_ex, runs the
+  workloads below against it and prints results as JSON on stdout.
+  Image I/O syscalls are counted through the __wrap_* functions below,
+  the binary is linked with -Wl,--wrap for each of them (see Makefile).
+  With -t the random read workload is also run from 1, 2, 4, ... threads
+  up to the given number, each checking the data it reads. The asynchronous
+  random read workload keeps -q requests in flight, its io_uring_enter calls
+  are counted by wrapping syscall().
+*/
+
+#define MAX_IO_SIZES 8
+
+//files read by the multi-threaded workload
+#define MT_FILES 8
+
+//log files appended to in turns and the size of each append
+#define APPEND_FILES 4
+#define APPEND_SIZE 200
+
+struct bench_opts {
+    char *image;
+    int image_size;
+    int block_size;
+    int mount_flags;
+    int file_size;
+    int nops;
+    int nfiles;
+    int io_sizes[MAX_IO_SIZES];
+    int nio_sizes;
+    int nthreads;
+    int aio_depth;
+};
+
+struct bench_result {
+    char name[64];
+    int io_size;
+    int nops;
+    long long bytes;
+    double elapsed;
+    double *lat;
+    long syscalls;
+    long cache_hits;
+    long cache_misses;
+};
+
+struct mt_arg {
+    struct vsfs *fs;
+    struct bench_opts *o;
+    int io_size;
+    int nops;
+    unsigned int seed;
+    double *lat;
+    long long bytes;
+    int err;
+};
+
+//wrappers may be called from several threads at once
+long nsyscalls;
+
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __real_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+off_t __real_lseek(int fd, off_t offset, int whence);
+int __real_fsync(int fd);
+int __real_msync(void *addr, size_t length, int flags);
+long __real_syscall(long number, ...);
+int __real_posix_fadvise(int fd, off_t offset, off_t len, int advice);
+int __real_madvise(void *addr, size_t length, int advice);
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset) {
+    __atomic_fetch_add(&nsyscalls, 1, __ATOMIC_RELAXED);
+    return __real_pread(fd, buf, count, offset);
+}
+
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    __atomic_fetch_add(&nsyscalls, 1, __ATOMIC_RELAXED);
+    return __real_pwrite(fd, buf, count, offset);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+    __atomic_fetch_add(&nsyscalls, 1, __ATOMIC_RELAXED);
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    __atomic_fetch_add(&nsyscalls, 1, __ATOMIC_RELAXED);
+    return __real_write(fd, buf, count);
+}
+
+off_t __wrap_lseek(int fd, off_t offset, int whence) {
+    __atomic_fetch_add(&nsyscalls, 1, __ATOMIC_RELAXED);
+    return __real_lseek(fd, offset, whence);
+}
+
+int __wrap_fsync(int fd) {
+    __atomic_fetch_add(&nsyscalls, 1, __ATOMIC_RELAXED);
+    return __real_fsync(fd);
+}
+
+int __wrap_msync(void *addr, size_t length, int flags) {
+    __atomic_fetch_add(&nsyscalls, 1, __ATOMIC_RELAXED);
+    return __real_msync(addr, length, flags);
+}
+
+int __wrap_posix_fadvise(int fd, off_t offset, off_t len, int advice) {
+    __atomic_fetch_add(&nsyscalls, 1, __ATOMIC_RELAXED);
+    return __real_posix_fadvise(fd, offset, len, advice);
+}
+
+int __wrap_madvise(void *addr, size_t length, int advice) {
+    __atomic_fetch_add(&nsyscalls, 1, __ATOMIC_RELAXED);
+    return __real_madvise(addr, length, advice);
+}
+
+long __wrap_syscall(long number, long a1, long a2, long a3, long a4, long a5, long a6) {
+    __atomic_fetch_add(&nsyscalls, 1, __ATOMIC_RELAXED);
+    return __real_syscall(number, a1, a2, a3, a4, a5, a6);
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(double *)a, y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+void result_start(struct vsfs *fs, struct bench_result *r, char *name, int io_size, int nops) {
+    struct vs_cache_stats cs;
+    vs_get_cache_stats(fs, &cs);
+    r->cache_hits = cs.hits;
+    r->cache_misses = cs.misses;
+
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->io_size = io_size;
+    r->nops = nops;
+    r->bytes = 0;
+    r->lat = malloc(nops * sizeof(double));
+    r->syscalls = nsyscalls;
+    r->elapsed = now();
+}
+
+void result_end(struct vsfs *fs, struct bench_result *r) {
+    r->elapsed = now() - r->elapsed;
+    r->syscalls = nsyscalls - r->syscalls;
+
+    struct vs_cache_stats cs;
+    vs_get_cache_stats(fs, &cs);
+    r->cache_hits = cs.hits - r->cache_hits;
+    r->cache_misses = cs.misses - r->cache_misses;
+}
+
+void print_result(struct bench_result *r, int last) {
+    qsort(r->lat, r->nops, sizeof(double), cmp_double);
+    double p50 = r->nops ? r->lat[r->nops / 2] : 0;
+    double p99 = r->nops ? r->lat[(int)(r->nops * 0.99)] : 0;
+
+    printf("    {\"name\": \"%s\", \"io_size\": %d, \"ops\": %d, "
+           "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+           "\"p50_us\": %.2f, \"p99_us\": %.2f, \"syscalls\": %ld, "
+           "\"syscalls_per_op\": %.2f, \"cache_hits\": %ld, \"cache_misses\": %ld}%s\n",
+           r->name, r->io_size, r->nops,
+           r->elapsed, r->elapsed > 0 ? r->nops / r->elapsed : 0,
+           r->elapsed > 0 ? r->bytes / r->elapsed / (1024 * 1024) : 0,
+           p50 * 1e6, p99 * 1e6, r->syscalls,
+           r->nops ? (double)r->syscalls / r->nops : 0,
+           r->cache_hits, r->cache_misses,
+           last ? "" : ",");
+    free(r->lat);
+}
+
+//offset of i-th operation, sequential or random, aligned to io_size
+int op_offset(struct bench_opts *o, int io_size, int i, int random) {
+    int nslots = o->file_size / io_size;
+    if (nslots < 1) nslots = 1;
+    int slot = random ? rand() % nslots : i % nslots;
+    return slot * io_size;
+}
+
+int bench_rw(struct vsfs *fs, struct bench_opts *o, struct bench_result *r,
+             int io_size, int write, int random) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s_%s", random ? "rand" : "seq", write ? "write" : "read");
+
+    int fd = vs_open(fs, "bench-data");
+    if (fd < 0) return fd;
+
+    char *buf = malloc(io_size);
+    memset(buf, 'x', io_size);
+
+    result_start(fs, r, name, io_size, o->nops);
+    for (int i = 0; i < o->nops; i++) {
+        int offset = op_offset(o, io_size, i, random);
+        double t = now();
+        int n = write
+                ? vs_write(fs, fd, offset, io_size, buf)
+                : vs_read(fs, fd, offset, io_size, buf);
+        r->lat[i] = now() - t;
+        if (n < 0) {
+            free(buf);
+            vs_close(fs, fd);
+            return n;
+        }
+        r->bytes += n;
+    }
+    result_end(fs, r);
+
+    free(buf);
+    return vs_close(fs, fd);
+}
+
+//with batch set creates and unlinks are grouped in one batch each, latencies include the commit
+int bench_create_unlink(struct vsfs *fs, struct bench_opts *o, struct bench_result *r, int batch) {
+    char name[MAX_NAMESIZE];
+    int n = o->nfiles;
+
+    result_start(fs, r, batch ? "create_unlink_batch" : "create_unlink", 0, 2 * n);
+    if (batch) vs_batch_begin(fs);
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "churn-%d", i);
+        double t = now();
+        int err = vs_create(fs, name);
+        if (batch && i == n - 1 && err == 0)
+            err = vs_batch_commit(fs);
+        r->lat[i] = now() - t;
+        if (err < 0) return err;
+    }
+    if (batch) vs_batch_begin(fs);
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "churn-%d", i);
+        double t = now();
+        int err = vs_unlink(fs, name);
+        if (batch && i == n - 1 && err == 0)
+            err = vs_batch_commit(fs);
+        r->lat[n + i] = now() - t;
+        if (err < 0) return err;
+    }
+    result_end(fs, r);
+    return 0;
+}
+
+int bench_links(struct vsfs *fs, struct bench_opts *o, struct bench_result *r) {
+    char name[MAX_NAMESIZE];
+    int n = o->nfiles;
+
+    result_start(fs, r, "link_storm", 0, 2 * n);
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "link-%d", i);
+        double t = now();
+        int err = vs_link(fs, "bench-data", name);
+        r->lat[i] = now() - t;
+        if (err < 0) return err;
+    }
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "link-%d", i);
+        double t = now();
+        int err = vs_unlink(fs, name);
+        r->lat[n + i] = now() - t;
+        if (err < 0) return err;
+    }
+    result_end(fs, r);
+    return 0;
+}
+
+int bench_truncate(struct vsfs *fs, struct bench_opts *o, struct bench_result *r) {
+    result_start(fs, r, "truncate_cycle", 0, o->nops);
+    for (int i = 0; i < o->nops; i++) {
+        int size = i % 2 ? o->file_size / 2 : o->file_size;
+        double t = now();
+        int err = vs_truncate(fs, "bench-data", size);
+        r->lat[i] = now() - t;
+        if (err < 0) return err;
+    }
+    result_end(fs, r);
+    return vs_truncate(fs, "bench-data", o->file_size);
+}
+
+//keeps nfiles descriptors of the data file open, each op closes the oldest
+//and opens a new one in its place
+int bench_open_close(struct vsfs *fs, struct bench_opts *o, struct bench_result *r) {
+    int n = o->nfiles;
+    int *fds = malloc(n * sizeof(int));
+    int err = 0;
+    for (int i = 0; i < n && err >= 0; i++)
+        err = fds[i] = vs_open(fs, "bench-data");
+
+    result_start(fs, r, "open_close", 0, o->nops);
+    for (int i = 0; i < o->nops && err >= 0; i++) {
+        double t = now();
+        err = vs_close(fs, fds[i % n]);
+        if (err >= 0)
+            err = fds[i % n] = vs_open(fs, "bench-data");
+        r->lat[i] = now() - t;
+    }
+    result_end(fs, r);
+
+    for (int i = 0; i < n && err >= 0; i++)
+        err = vs_close(fs, fds[i]);
+    free(fds);
+    return err < 0 ? err : 0;
+}
+
+//small appends to several files in turns, as loggers do; closing the files
+//and the vs_sync writing their blocks are counted with the last append
+int bench_append(struct vsfs *fs, struct bench_opts *o, struct bench_result *r) {
+    char name[MAX_NAMESIZE];
+    char buf[APPEND_SIZE];
+    int fds[APPEND_FILES];
+    memset(buf, 'l', sizeof(buf));
+    for (int i = 0; i < APPEND_FILES; i++) {
+        snprintf(name, sizeof(name), "log-%d", i);
+        int err = vs_create(fs, name);
+        if (err < 0) return err;
+        if ((fds[i] = vs_open(fs, name)) < 0) return fds[i];
+    }
+
+    int err = 0;
+    result_start(fs, r, "append_interleaved", APPEND_SIZE, o->nops);
+    for (int i = 0; i < o->nops && err >= 0; i++) {
+        double t = now();
+        err = vs_seq_write(fs, fds[i % APPEND_FILES], APPEND_SIZE, buf);
+        if (err >= 0)
+            r->bytes += err;
+        if (i == o->nops - 1) {
+            for (int j = 0; j < APPEND_FILES && err >= 0; j++)
+                err = vs_close(fs, fds[j]);
+            if (err >= 0)
+                err = vs_sync(fs);
+        }
+        r->lat[i] = now() - t;
+    }
+    result_end(fs, r);
+
+    for (int i = 0; i < APPEND_FILES && err >= 0; i++) {
+        snprintf(name, sizeof(name), "log-%d", i);
+        err = vs_unlink(fs, name);
+    }
+    return err < 0 ? err : 0;
+}
+
+int bench_readdir(struct vsfs *fs, struct bench_opts *o, struct bench_result *r) {
+    struct dir_rec rec;
+    int nscans = o->nops / 100 > 0 ? o->nops / 100 : 1;
+
+    result_start(fs, r, "readdir_scan", 0, nscans);
+    for (int i = 0; i < nscans; i++) {
+        int cursor = 0;
+        double t = now();
+        do {
+            int err = vs_readdir(fs, &rec, &cursor);
+            if (err < 0) return err;
+        } while (rec.id != END_ID);
+        r->lat[i] = now() - t;
+    }
+    result_end(fs, r);
+    return 0;
+}
+
+//contents of the multi-threaded workload files
+char mt_pattern(int file, int offset) {
+    return (char)(file * 131 + offset / 61);
+}
+
+int mt_setup(struct vsfs *fs, struct bench_opts *o) {
+    char name[MAX_NAMESIZE];
+    char *buf = malloc(o->file_size);
+    for (int f = 0; f < MT_FILES; f++) {
+        snprintf(name, sizeof(name), "mt-%d", f);
+        for (int i = 0; i < o->file_size; i++)
+            buf[i] = mt_pattern(f, i);
+
+        int fd, err;
+        if ((err = vs_create(fs, name)) < 0 || (fd = err = vs_open(fs, name)) < 0) {
+            free(buf);
+            return err;
+        }
+        err = vs_write(fs, fd, 0, o->file_size, buf);
+        vs_close(fs, fd);
+        if (err < o->file_size) {
+            free(buf);
+            return err < 0 ? err : -1;
+        }
+    }
+    free(buf);
+    return vs_sync(fs);
+}
+
+void *mt_reader(void *p) {
+    struct mt_arg *a = p;
+    char name[MAX_NAMESIZE];
+    int fds[MT_FILES];
+    for (int f = 0; f < MT_FILES; f++) {
+        snprintf(name, sizeof(name), "mt-%d", f);
+        if ((fds[f] = vs_open(a->fs, name)) < 0) {
+            a->err = fds[f];
+            return NULL;
+        }
+    }
+
+    char *buf = malloc(a->io_size);
+    int nslots = a->o->file_size / a->io_size;
+    if (nslots < 1) nslots = 1;
+    for (int i = 0; i < a->nops && !a->err; i++) {
+        int f = rand_r(&a->seed) % MT_FILES;
+        int offset = rand_r(&a->seed) % nslots * a->io_size;
+        double t = now();
+        int n = vs_read(a->fs, fds[f], offset, a->io_size, buf);
+        a->lat[i] = now() - t;
+        if (n < 0) {
+            a->err = n;
+        } else if (n > 0 && (buf[0] != mt_pattern(f, offset)
+                             || buf[n - 1] != mt_pattern(f, offset + n - 1))) {
+            fprintf(stderr, "Error: mt-%d read wrong data at %d\n", f, offset);
+            a->err = -1;
+        }
+        a->bytes += n > 0 ? n : 0;
+    }
+    free(buf);
+    for (int f = 0; f < MT_FILES; f++)
+        vs_close(a->fs, fds[f]);
+    return NULL;
+}
+
+//o->nops random reads spread over nthreads threads, each with its own descriptors
+int bench_mt_read(struct vsfs *fs, struct bench_opts *o, struct bench_result *r, int io_size, int nthreads) {
+    char name[64];
+    snprintf(name, sizeof(name), "mt_rand_read_%dt", nthreads);
+
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    struct mt_arg *args = calloc(nthreads, sizeof(struct mt_arg));
+    int per_thread = o->nops / nthreads;
+
+    result_start(fs, r, name, io_size, per_thread * nthreads);
+    for (int t = 0; t < nthreads; t++) {
+        args[t].fs = fs;
+        args[t].o = o;
+        args[t].io_size = io_size;
+        args[t].nops = per_thread;
+        args[t].seed = t + 1;
+        args[t].lat = r->lat + t * per_thread;
+        pthread_create(&threads[t], NULL, mt_reader, &args[t]);
+    }
+    int err = 0;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+        r->bytes += args[t].bytes;
+        if (args[t].err < 0) err = args[t].err;
+    }
+    result_end(fs, r);
+
+    free(threads);
+    free(args);
+    return err;
+}
+
+//o->nops random reads through vs_aio_submit keeping o->aio_depth of them in
+//flight, finished requests are resubmitted together. Latency is from submission
+//to collection
+int bench_aio_read(struct vsfs *fs, struct bench_opts *o, struct bench_result *r, int io_size) {
+    int depth = o->aio_depth;
+    int fd = vs_open(fs, "bench-data");
+    if (fd < 0) return fd;
+
+    struct vs_aio *reqs = calloc(depth, sizeof(struct vs_aio));
+    struct vs_aio **batch = malloc(depth * sizeof(struct vs_aio *));
+    double *started = malloc(depth * sizeof(double));
+    char *bufs = malloc((size_t)depth * io_size);
+
+    result_start(fs, r, "aio_rand_read", io_size, o->nops);
+    int nbatch = 0;
+    for (int i = 0; i < depth && i < o->nops; i++)
+        batch[nbatch++] = &reqs[i];
+    int issued = 0, done = 0, err = 0;
+    while (done < o->nops && !err) {
+        double t = now();
+        for (int i = 0; i < nbatch; i++) {
+            struct vs_aio *req = batch[i];
+            req->opcode = VS_AIO_READ;
+            req->fd = fd;
+            req->offset = op_offset(o, io_size, issued++, 1);
+            req->size = io_size;
+            req->buffer = bufs + (size_t)(req - reqs) * io_size;
+            started[req - reqs] = t;
+        }
+        if (nbatch > 0 && (err = vs_aio_submit(fs, batch, nbatch)) < 0)
+            break;
+        err = 0;
+
+        int n = vs_aio_wait(fs, batch, 1, depth);
+        t = now();
+        nbatch = 0;
+        for (int i = 0; i < n; i++) {
+            struct vs_aio *req = batch[i];
+            r->lat[done++] = t - started[req - reqs];
+            if (req->result < 0)
+                err = req->result;
+            else
+                r->bytes += req->result;
+            if (issued + nbatch < o->nops)
+                batch[nbatch++] = req;
+        }
+    }
+    result_end(fs, r);
+
+    //requests still in flight after an error are waited for before their buffers go
+    while (vs_aio_wait(fs, NULL, depth, depth) > 0)
+        ;
+    free(reqs);
+    free(batch);
+    free(started);
+    free(bufs);
+    vs_close(fs, fd);
+    return err;
+}
+
+int parse_sizes(char *arg, struct bench_opts *o) {
+    o->nio_sizes = 0;
+    for (char *tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (o->nio_sizes == MAX_IO_SIZES || atoi(tok) <= 0)
+            return -1;
+        o->io_sizes[o->nio_sizes++] = atoi(tok);
+    }
+    return o->nio_sizes > 0 ? 0 : -1;
+}
+
+void usage(char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-i image] [-s image_size] [-b block_size] [-f file_size]\n"
+            "          [-n ops] [-c files] [-z io_size,io_size,...] [-m] [-t threads]\n"
+            "          [-q aio_depth] [-h]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_opts o = {
+        .image = "vsfs-bench.img",
+        .image_size = 64 * 1024 * 1024,
+        .block_size = 0,
+        .mount_flags = 0,
+        .file_size = 4 * 1024 * 1024,
+        .nops = 2000,
+        .nfiles = 1000,
+        .io_sizes = {256, 4096, 65536},
+        .nio_sizes = 3,
+        .nthreads = 0,
+        .aio_depth = 32
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:s:b:f:n:c:z:mt:q:h")) != -1) {
+        switch (opt) {
+            case 'i': o.image = optarg; break;
+            case 's': o.image_size = atoi(optarg); break;
+            case 'b': o.block_size = atoi(optarg); break;
+            case 'f': o.file_size = atoi(optarg); break;
+            case 'n': o.nops = atoi(optarg); break;
+            case 'c': o.nfiles = atoi(optarg); break;
+            case 'm': o.mount_flags |= VS_MOUNT_MMAP; break;
+            case 't': o.nthreads = atoi(optarg); break;
+            case 'q': o.aio_depth = atoi(optarg); break;
+            case 'z':
+                if (parse_sizes(optarg, &o) < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (o.nops <= 0 || o.nfiles <= 0 || o.file_size <= 0 || o.nthreads < 0 || o.aio_depth <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    srand(1);
+
+    struct vs_mkfs_opts mkfs_opts = {
+        .block_size = o.block_size
+    };
+    int err;
+    if ((err = vs_mkfs_ex(o.image, o.image_size, &mkfs_opts)) < 0) {
+        fprintf(stderr, "Error: vs_mkfs failed (%d)\n", err);
+        return 1;
+    }
+
+    struct vsfs *fs;
+    if ((err = vs_mount_ex(o.image, o.mount_flags, &fs)) < 0) {
+        fprintf(stderr, "Error: vs_mount failed (%d)\n", err);
+        return 1;
+    }
+
+    if ((err = vs_create(fs, "bench-data")) < 0
+            || (err = vs_truncate(fs, "bench-data", o.file_size)) < 0) {
+        fprintf(stderr, "Error: unable to create data file (%d)\n", err);
+        return 1;
+    }
+
+    int nsteps = 0;
+    for (int t = 1; t <= o.nthreads; t *= 2)
+        nsteps++;
+
+    int nresults = 5 * o.nio_sizes + 7 + nsteps * o.nio_sizes;
+    struct bench_result *results = calloc(nresults, sizeof(struct bench_result));
+    int k = 0;
+    for (int s = 0; s < o.nio_sizes && !err; s++) {
+        for (int w = 0; w < 4 && !err; w++) {
+            err = bench_rw(fs, &o, &results[k++], o.io_sizes[s], w < 2, w % 2);
+        }
+    }
+    if (!err) err = bench_create_unlink(fs, &o, &results[k++], 0);
+    if (!err) err = bench_create_unlink(fs, &o, &results[k++], 1);
+    if (!err) err = bench_links(fs, &o, &results[k++]);
+    if (!err) err = bench_truncate(fs, &o, &results[k++]);
+    if (!err) err = bench_readdir(fs, &o, &results[k++]);
+    if (!err) err = bench_open_close(fs, &o, &results[k++]);
+    if (!err) err = bench_append(fs, &o, &results[k++]);
+    for (int s = 0; s < o.nio_sizes && !err; s++)
+        err = bench_aio_read(fs, &o, &results[k++], o.io_sizes[s]);
+    if (!err && o.nthreads > 0 && (err = mt_setup(fs, &o)) < 0) {
+        fprintf(stderr, "Error: unable to create files for threads (%d)\n", err);
+        return 1;
+    }
+    for (int s = 0; s < o.nio_sizes && o.nthreads > 0 && !err; s++) {
+        for (int t = 1; t <= o.nthreads && !err; t *= 2)
+            err = bench_mt_read(fs, &o, &results[k++], o.io_sizes[s], t);
+    }
+
+    if (err < 0) {
+        fprintf(stderr, "Error: workload %s failed (%d)\n", results[k-1].name, err);
+        return 1;
+    }
+    vs_umount(fs);
+
+    printf("{\n");
+    printf("  \"image_size\": %d,\n", o.image_size);
+    printf("  \"block_size\": %d,\n", o.block_size ? o.block_size : BLOCK_SIZE);
+    printf("  \"mmap\": %d,\n", (o.mount_flags & VS_MOUNT_MMAP) ? 1 : 0);
+    printf("  \"file_size\": %d,\n", o.file_size);
+    printf("  \"results\": [\n");
+    for (int i = 0; i < k; i++)
+        print_result(&results[i], i == k - 1);
+    printf("  ]\n}\n");
+
+    free(results);
+    unlink(o.image);
+    return 0;
+}
@@ -21,7 +21,10 @@ enum cmds_enum {
     WRITE_CMD,
     LINK_CMD, 
     UNLINK_CMD, 
-    TRUNCATE_CMD
+    TRUNCATE_CMD,
+    STATFS_CMD,
+    DEFRAG_CMD,
+    STATS_CMD
 };
 
 char *commands[] = {
@@ -37,12 +40,34 @@ char *commands[] = {
     "write", 
     "link", 
     "unlink", 
-    "truncate"
+    "truncate",
+    "statfs",
+    "defrag",
+    "stats"
+};
+
+//names of VS_OP_* operations
+char *op_names[VS_NOPS] = {
+    "vs_open",
+    "vs_read",
+    "vs_write",
+    "vs_create",
+    "vs_unlink",
+    "vs_truncate",
+    "vs_link",
+    "vs_readdir",
+    "get_block_id",
+    "occupy_next_block",
+    "read_dirtab",
+    "write_fstat"
 };
 
 int isMounted = 0;
+struct vsfs *fs;
 
 void exec(char *input, int cmd_id);
+void print_frag(char *what, struct vs_frag *frag);
+long lat_percentile(struct vs_op_stats *op, double p);
 
 int main(int argc, char *argv[]) {
     char input[256];
@@ -82,13 +107,13 @@ void exec(char *input, int cmd_id) {
 
     switch (cmd_id) {
         case MKFS_CMD: {
-            int size;
-            char *filename, *size_str;
+            long long size;
+            char *filename, *size_str, *bsize_str, *opt_str;
             char *context;
             if (NULL == (filename = strtok_r(input, " ", &context)) ||
                 NULL == (size_str = strtok_r(NULL, " ", &context))) {
 
-                printf("Error: Missing argument. Usage: mkfs [file_path] [size]\n");
+                printf("Error: Missing argument. Usage: mkfs [file_path] [size] [block_size] [prealloc] [lazy] [nojournal]\n");
                 return;
             }
 
@@ -97,29 +122,62 @@ void exec(char *input, int cmd_id) {
                 return;
             }
 
-            size = atoi(size_str);
+            size = atoll(size_str);
+
+            struct vs_mkfs_opts opts = {
+                .block_size = 0,
+                .flags = 0
+            };
+            opt_str = bsize_str = strtok_r(NULL, " ", &context);
+            if (NULL != bsize_str && bsize_str[0] >= '0' && bsize_str[0] <= '9') {
+                opts.block_size = atoi(bsize_str);
+                opt_str = strtok_r(NULL, " ", &context);
+            }
+            for (; opt_str != NULL; opt_str = strtok_r(NULL, " ", &context)) {
+                if (0 == strcmp(opt_str, "prealloc")) {
+                    opts.flags |= VS_MKFS_PREALLOC;
+                } else if (0 == strcmp(opt_str, "lazy")) {
+                    opts.flags |= VS_MKFS_LAZY;
+                } else if (0 == strcmp(opt_str, "nojournal")) {
+                    opts.flags |= VS_MKFS_NOJOURNAL;
+                } else {
+                    printf("Error: Unknown mkfs option %s\n", opt_str);
+                    return;
+                }
+            }
 
             int err;
-            if (!(err = vs_mkfs(filename, size))) {
+            if (!(err = vs_mkfs_ex(filename, size, &opts))) {
                 printf("VSFS successfully created under image %s\n", filename);
             } else {
                 if (err == -CREATE_ERR) printf("Error: Unable to create image\n");
                 else if (err == -WRITE_ERR) printf("Error: Unable to write in image\n");
                 else if (err == -SIZE_ERR) printf("Error: Too small FS image size\n");
+                else if (err == -BLOCKSIZE_ERR) printf("Error: Block size must be a power of two from %d to %d\n", BLOCK_SIZE, MAX_BLOCK_SIZE);
                 else printf("Error\n");
             }
             break;
         };
         case MOUNT_CMD: {
             if (!isMounted) {
-                char *filename;
-                if (NULL == (filename = strtok(input, " "))){
-                    printf("Error: Missing argument. Usage: mount [fs_file_pathname]\n");
+                char *filename, *mode_str;
+                char *context;
+                if (NULL == (filename = strtok_r(input, " ", &context))){
+                    printf("Error: Missing argument. Usage: mount [fs_file_pathname] [mmap]\n");
                     return;
                 }
 
+                int flags = 0;
+                if (NULL != (mode_str = strtok_r(NULL, " ", &context))) {
+                    if (0 != strcmp(mode_str, "mmap")) {
+                        printf("Error: Unknown mount option %s\n", mode_str);
+                        return;
+                    }
+                    flags |= VS_MOUNT_MMAP;
+                }
+
                 int err;
-                if (!(err=vs_mount(filename))) {
+                if (!(err=vs_mount_ex(filename, flags, &fs))) {
                     isMounted = 1;
                     printf("Filesystem successfully mounted\n");
                 } else {
@@ -136,7 +194,7 @@ void exec(char *input, int cmd_id) {
         };
         case UMOUNT_CMD: {
             int err;
-            if (!(err=vs_umount())) {
+            if (!(err=vs_umount(fs))) {
                 isMounted = 0;
                 printf("Filesystem successfully unmounted\n");
             } else {
@@ -160,7 +218,7 @@ void exec(char *input, int cmd_id) {
 
             id = atoi(id_str);
             struct fstat *fstat = malloc(sizeof(struct fstat));
-            int err = vs_getstat(id, fstat);
+            int err = vs_getstat(fs, id, fstat);
 
             if(err == -READ_ERR) printf("Error: Unable to read from image\n");
             else if (err < 0) printf("Error\n");
@@ -179,16 +237,16 @@ void exec(char *input, int cmd_id) {
             break;
         }
         case LS_CMD: {
-            int size;
+            int cursor = 0;
             struct dir_rec *dirrec = malloc(sizeof(struct dir_rec));
-            int err = vs_readdir(dirrec, 0);
+            int err = vs_readdir(fs, dirrec, &cursor);
 
             if (err == -READ_ERR) printf("Error: Unable to read from image\n");
             else if (err < 0) printf("Error\n");
 
             while (dirrec->id != END_ID) {
                 if (dirrec->id != -1) printf("%d  %s\n", dirrec->id, dirrec->name);
-                err = vs_readdir(dirrec, 1);
+                err = vs_readdir(fs, dirrec, &cursor);
                 
                 if(err == -READ_ERR) printf("Error: Unable to read from image\n");
                 else if (err < 0) printf("Error\n");
@@ -203,7 +261,7 @@ void exec(char *input, int cmd_id) {
                 return;
             }
             int err;
-            if (!(err=vs_create(pathname))) {
+            if (!(err=vs_create(fs, pathname))) {
                 printf("File %s successfully created\n", pathname);
             } else {
                 if (err == -WRITE_ERR) printf("Error: Unable to write to image\n");
@@ -220,7 +278,7 @@ void exec(char *input, int cmd_id) {
                 printf("Error: Missing argument. Usage: open [file_pathname]\n");
                 return;
             }
-            int fd = vs_open(pathname);
+            int fd = vs_open(fs, pathname);
 
             if (fd >= 0) {
                 printf("File %s successfully opened with descriptor %d\n", pathname, fd);
@@ -248,7 +306,7 @@ void exec(char *input, int cmd_id) {
             fd = atoi(fd_str);
 
             int err;
-            if ((err = vs_close(fd)) >= 0) {
+            if ((err = vs_close(fs, fd)) >= 0) {
                 printf("File descriptor %d successfully closed\n", fd);
             } else {
                 if (err == -BADDESC_ERR) printf("Error: Bad descriptor\n");
@@ -289,7 +347,7 @@ void exec(char *input, int cmd_id) {
             char *buffer = calloc(size, sizeof(char));
 
             int err;
-            if ((err=vs_read(fd, offset, size, buffer)) >= 0 ) {
+            if ((err=vs_read(fs, fd, offset, size, buffer)) >= 0 ) {
                 printf("%s\n", buffer);
             } else {
                 if (err == -BADDESC_ERR) printf("Error: Bad descriptor\n");
@@ -333,7 +391,7 @@ void exec(char *input, int cmd_id) {
                 buffer[i] = getchar();
             }
             int err;
-            if ((err=vs_write(fd, offset, size, buffer)) >= 0) {
+            if ((err=vs_write(fs, fd, offset, size, buffer)) >= 0) {
                 printf("File %d successfully written\n", fd);
             } else {
                 if (err == -BADDESC_ERR) printf("Error: Bad descriptor\n");
@@ -357,11 +415,12 @@ void exec(char *input, int cmd_id) {
             }
             
             int err;
-            if (!(err=vs_link(src_str, dest_str))) {
+            if (!(err=vs_link(fs, src_str, dest_str))) {
                 printf("Hard link successfully created\n");
             } else {
                 if (err == -NOTEXIST_ERR) printf("Error: Source doesn't exist\n");
                 else if (err == -EXIST_ERR) printf("Error: Destination already exists\n");
+                else if (err == -MAXFILES_ERR) printf("Error: Directory is full\n");
                 else if (err == -READ_ERR) printf("Error: Unable to read from image\n");
                 else if (err == -WRITE_ERR) printf("Error: Unable to write to image\n");
                 else printf("Error\n");
@@ -376,7 +435,7 @@ void exec(char *input, int cmd_id) {
             }
 
             int err;
-            if (!(err=vs_unlink(pathname))) {
+            if (!(err=vs_unlink(fs, pathname))) {
                 printf("File %s successfully unlinked\n", pathname);
             } else {
                 if (err == -NOTEXIST_ERR) printf("Error: File doesn't exist\n");
@@ -405,7 +464,7 @@ void exec(char *input, int cmd_id) {
             new_size = atoi(size_str);
 
             int err;
-            if (!(err=vs_truncate(pathname, new_size))) {
+            if (!(err=vs_truncate(fs, pathname, new_size))) {
                 printf("File successfully truncated\n");
             } else {
                 if (err == -NOTEXIST_ERR) printf("Error: File doesn't exist\n");
@@ -415,5 +474,104 @@ void exec(char *input, int cmd_id) {
             }
             break;
         }
+        case STATFS_CMD: {
+            struct vs_statfs st;
+            vs_statfs(fs, &st);
+            printf("block size: %d\nblocks: %d\nfree blocks: %d\nfiles: %d\nfree files: %d\nfree names: %d\n",
+                   st.block_size, st.blocks, st.blocks_free, st.files, st.files_free, st.names_free);
+            break;
+        }
+        case DEFRAG_CMD: {
+            char *pathname = NULL, *opt_str;
+            char *context;
+            int flags = 0, check = 0;
+            for (opt_str = strtok_r(input, " ", &context); opt_str != NULL; opt_str = strtok_r(NULL, " ", &context)) {
+                if (0 == strcmp(opt_str, "compact")) {
+                    flags |= VS_DEFRAG_COMPACT;
+                } else if (0 == strcmp(opt_str, "check")) {
+                    check = 1;
+                } else if (NULL == pathname) {
+                    pathname = opt_str;
+                } else {
+                    printf("Error: Too many arguments. Usage: defrag [file_pathname] [compact] [check]\n");
+                    return;
+                }
+            }
+
+            struct vs_frag before, after;
+            int err = vs_fragstat(fs, pathname, &before);
+
+            //fragmented files are listed when the whole image is looked at
+            if (!err && NULL == pathname) {
+                int cursor = 0;
+                struct dir_rec dirrec;
+                struct vs_frag frag;
+                while (!vs_readdir(fs, &dirrec, &cursor) && dirrec.id != END_ID) {
+                    if (dirrec.id != -1 && !vs_fragstat(fs, dirrec.name, &frag) && frag.runs > 1)
+                        printf("%s: %d blocks in %d runs\n", dirrec.name, frag.blocks, frag.runs);
+                }
+            }
+            if (!err && !check)
+                err = vs_defrag(fs, pathname, flags, &after);
+
+            if (!err) {
+                print_frag(check ? "fragmentation" : "before", &before);
+                if (!check) print_frag("after", &after);
+            } else {
+                if (err == -NOTEXIST_ERR) printf("Error: File doesn't exist\n");
+                else if (err == -EOF_ERR) printf("Error: No free space to move the file to\n");
+                else if (err == -READ_ERR) printf("Error: Unable to read from image\n");
+                else if (err == -WRITE_ERR) printf("Error: Unable to write to image\n");
+                else printf("Error\n");
+            }
+            break;
+        }
+        case STATS_CMD: {
+            char *opt_str = strtok(input, " ");
+            if (NULL != opt_str && 0 == strcmp(opt_str, "reset")) {
+                vs_reset_stats(fs);
+                printf("Statistics reset\n");
+                break;
+            } else if (NULL != opt_str) {
+                printf("Error: Unknown stats option %s. Usage: stats [reset]\n", opt_str);
+                return;
+            }
+
+            struct vs_stats *st = malloc(sizeof(struct vs_stats));
+            vs_get_stats(fs, st);
+            if (!st->enabled) {
+                printf("Error: Statistics are not built in, rebuild with make STATS=1\n");
+                free(st);
+                break;
+            }
+
+            printf("%-18s %10s %8s %12s %10s %10s %10s %10s\n",
+                   "operation", "calls", "errors", "bytes", "syscalls", "avg ns", "p50 ns", "p99 ns");
+            for (int i = 0; i < VS_NOPS; i++) {
+                struct vs_op_stats *op = &st->ops[i];
+                if (op->calls == 0) continue;
+                printf("%-18s %10ld %8ld %12ld %10ld %10ld %10ld %10ld\n", op_names[i], op->calls, op->errors,
+                       op->bytes, op->syscalls, op->ns / op->calls, lat_percentile(op, 0.5), lat_percentile(op, 0.99));
+            }
+            free(st);
+            break;
+        }
     }
 }
+
+//upper bound of the histogram bucket holding the p-th fraction of calls
+long lat_percentile(struct vs_op_stats *op, double p) {
+    long calls = 0, rank = (long)(p * op->calls);
+    for (int i = 0; i < VS_LAT_BUCKETS; i++) {
+        calls += op->lat[i];
+        if (calls > rank) return 1L << i;
+    }
+    return 1L << (VS_LAT_BUCKETS - 1);
+}
+
+//runs per file are the fragmentation metric, 1.0 when every file is contiguous
+void print_frag(char *what, struct vs_frag *frag) {
+    printf("%s: %d of %d files fragmented, %d blocks in %d runs (%.2f runs per file)\n",
+           what, frag->fragmented, frag->files, frag->blocks, frag->runs,
+           frag->files ? (double)frag->runs / frag->files : 0.0);
+}
@@ -11,4 +11,5 @@
 #define MAXFILES_ERR 12
 #define EOF_ERR 13
 #define OPEN_ERR 14
-#define END_ID -15
\ No newline at end of file
+#define END_ID -15
+#define BLOCKSIZE_ERR 16
\ No newline at end of file
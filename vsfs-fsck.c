@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vsfs.h"
+#include "vsfs-errors.h"
+
+/*
+  Checks a VSFS image that is not mounted (see vs_fsck) and prints what was
+  found. Exit status follows fsck(8): 0 nothing wrong, 1 problems repaired,
+  4 problems left, 8 the image could not be checked.
+*/
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-r] [-j threads] image\n"
+                    "  -r          repair the problems found\n"
+                    "  -j threads  threads scanning inodes, one per CPU by default\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int flags = 0;
+    int nthreads = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        switch (opt) {
+            case 'r': flags |= VS_FSCK_REPAIR; break;
+            case 'j': nthreads = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 8;
+        }
+    }
+    if (optind != argc - 1 || nthreads < 0) {
+        usage(argv[0]);
+        return 8;
+    }
+
+    struct vs_fsck_report r;
+    int err = vs_fsck(argv[optind], flags, nthreads, &r);
+    if (err < 0) {
+        if (err == -OPEN_ERR) fprintf(stderr, "Error: Unable to open image\n");
+        else if (err == -MARKER_ERR) fprintf(stderr, "Error: Not a VSFS image\n");
+        else if (err == -READ_ERR) fprintf(stderr, "Error: Unable to read image\n");
+        else if (err == -WRITE_ERR) fprintf(stderr, "Error: Unable to write in image\n");
+        else fprintf(stderr, "Error\n");
+        return 8;
+    }
+
+    struct {
+        int count;
+        char *what;
+    } problems[] = {
+        {r.leaked_blocks, "blocks marked used but used by no file"},
+        {r.lost_blocks, "blocks used by files but marked free"},
+        {r.shared_blocks, "blocks used more than once"},
+        {r.bad_block_refs, "bad block references"},
+        {r.blocks_past_size, "blocks mapped past the end of file"},
+        {r.bad_sizes, "bad file sizes"},
+        {r.bad_nlinks, "wrong link counts"},
+        {r.orphans, "files without directory records"},
+        {r.bad_dir_recs, "records of unused inodes"}
+    };
+
+    int found = 0;
+    for (int i = 0; i < (int)(sizeof(problems) / sizeof(problems[0])); i++) {
+        if (problems[i].count == 0)
+            continue;
+        printf("%d %s\n", problems[i].count, problems[i].what);
+        found = 1;
+    }
+    printf("%s: %d files, %d blocks used%s\n", argv[optind], r.files, r.blocks_used,
+           !found ? ", clean" : r.repaired ? ", repaired" : "");
+
+    //blocks used more than once are only reported
+    if (!found)
+        return 0;
+    return r.repaired && r.shared_blocks == 0 ? 1 : 4;
+}
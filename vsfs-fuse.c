@@ -0,0 +1,519 @@
+#define FUSE_USE_VERSION 34
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "vsfs.h"
+#include "vsfs-errors.h"
+
+/*
+  Mounts a VSFS image through the FUSE low-level API. The image has a single
+  directory, the root; a file is the inode number of its vsfs inode id + 2,
+  since 1 is the root. The image is only changed through the mount while it
+  is mounted, so the kernel may cache pages and attributes for long and
+  write back through its own cache. Requests are served by several threads,
+  the library is safe to call from all of them.
+*/
+
+#define ROOT_INO FUSE_ROOT_ID
+#define ID_INO(id) ((fuse_ino_t)(id) + 2)
+#define INO_ID(ino) ((int)(ino) - 2)
+
+//attributes and names are valid for this long in the kernel caches, seconds
+#define CACHE_TIMEOUT 60.0
+
+//largest read and write requests taken from the kernel
+#define FUSE_MAX_IO (1024 * 1024)
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+struct vsfs *fs;
+
+//a name of each file, vs_open and the other name calls need one for an inode
+char (*names)[MAX_NAMESIZE + 1];
+int nnames;
+pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char *image;
+
+//a rename is made in one batch, so that it is committed as one journal
+//transaction; fsync holds the lock too so that it never commits half of one
+pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int errno_of(int err) {
+    switch (err) {
+        case -NOTEXIST_ERR: return ENOENT;
+        case -EXIST_ERR: return EEXIST;
+        case -MAXFILES_ERR: return ENOSPC;
+        case -EOF_ERR: return ENOSPC;
+        case -MAX_FOPENED_ERR: return EMFILE;
+        case -BADDESC_ERR: return EBADF;
+        case -SIZE_ERR: return EFBIG;
+        default: return EIO;
+    }
+}
+
+int valid_name(const char *name) {
+    return strlen(name) <= MAX_NAMESIZE;
+}
+
+void remember_name(int id, const char *name) {
+    if (id < 0 || id >= nnames)
+        return;
+    pthread_mutex_lock(&names_lock);
+    strncpy(names[id], name, MAX_NAMESIZE);
+    names[id][MAX_NAMESIZE] = 0;
+    pthread_mutex_unlock(&names_lock);
+}
+
+//copies a name of file id to name, the one remembered if it still names the
+//file, else the first record of the file found in the directory
+int name_of(int id, char *name) {
+    if (id < 0 || id >= nnames)
+        return -NOTEXIST_ERR;
+
+    pthread_mutex_lock(&names_lock);
+    memcpy(name, names[id], MAX_NAMESIZE + 1);
+    pthread_mutex_unlock(&names_lock);
+    if (name[0] != 0 && vs_lookup(fs, name) == id)
+        return 0;
+
+    struct dir_rec rec;
+    int cursor = 0;
+    while (vs_readdir(fs, &rec, &cursor) == 0 && rec.id != END_ID) {
+        if (rec.id != id)
+            continue;
+        memcpy(name, rec.name, MAX_NAMESIZE);
+        name[MAX_NAMESIZE] = 0;
+        remember_name(id, name);
+        return 0;
+    }
+    return -NOTEXIST_ERR;
+}
+
+int fill_attr(fuse_ino_t ino, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_ino = ino;
+    if (ino == ROOT_INO) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        return 0;
+    }
+
+    //file unlinked while open has no links left but is still there
+    struct fstat fst;
+    int id = INO_ID(ino);
+    if (id < 0 || id >= nnames || vs_getstat(fs, id, &fst) < 0)
+        return -NOTEXIST_ERR;
+    st->st_mode = S_IFREG | 0644;
+    st->st_nlink = fst.nlinks;
+    st->st_size = fst.size;
+    st->st_blocks = (fst.size + 511) / 512;
+    st->st_blksize = FUSE_MAX_IO;
+    return 0;
+}
+
+void reply_entry(fuse_req_t req, int id) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = ID_INO(id);
+    e.attr_timeout = CACHE_TIMEOUT;
+    e.entry_timeout = CACHE_TIMEOUT;
+    if (fill_attr(e.ino, &e.attr) < 0)
+        fuse_reply_err(req, ENOENT);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+void vsfs_init(void *userdata, struct fuse_conn_info *conn) {
+    conn->max_write = FUSE_MAX_IO;
+    conn->max_readahead = FUSE_MAX_IO;
+    if (conn->capable & FUSE_CAP_ASYNC_READ)
+        conn->want |= FUSE_CAP_ASYNC_READ;
+    if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+}
+
+void vsfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (parent != ROOT_INO) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if (!valid_name(name)) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+
+    int id = vs_lookup(fs, (char *)name);
+    if (id < 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    remember_name(id, name);
+    reply_entry(req, id);
+}
+
+void vsfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat st;
+    if (fill_attr(ino, &st) < 0)
+        fuse_reply_err(req, ENOENT);
+    else
+        fuse_reply_attr(req, &st, CACHE_TIMEOUT);
+}
+
+//only the size can be changed, other attributes are not kept and are ignored
+void vsfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    if (ino == ROOT_INO) {
+        fuse_reply_err(req, (to_set & FUSE_SET_ATTR_SIZE) ? EISDIR : 0);
+        return;
+    }
+
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        char name[MAX_NAMESIZE + 1];
+        int err = attr->st_size > INT_MAX ? -SIZE_ERR : name_of(INO_ID(ino), name);
+        if (err == 0)
+            err = vs_truncate(fs, name, attr->st_size);
+        if (err < 0) {
+            fuse_reply_err(req, errno_of(err));
+            return;
+        }
+    }
+
+    struct stat st;
+    if (fill_attr(ino, &st) < 0)
+        fuse_reply_err(req, ENOENT);
+    else
+        fuse_reply_attr(req, &st, CACHE_TIMEOUT);
+}
+
+//offset of an entry is the directory cursor past its record
+void vsfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    if (ino != ROOT_INO) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    size_t len = 0;
+    int cursor = off;
+    struct dir_rec rec;
+    while (vs_readdir(fs, &rec, &cursor) == 0 && rec.id != END_ID) {
+        if (rec.id < 0)
+            continue;
+
+        char name[MAX_NAMESIZE + 1];
+        memcpy(name, rec.name, MAX_NAMESIZE);
+        name[MAX_NAMESIZE] = 0;
+        struct stat st = {
+            .st_ino = ID_INO(rec.id),
+            .st_mode = S_IFREG
+        };
+        size_t entsize = fuse_add_direntry(req, buf + len, size - len, name, &st, cursor);
+        if (entsize > size - len)
+            break;
+        len += entsize;
+        remember_name(rec.id, name);
+    }
+    fuse_reply_buf(req, buf, len);
+    free(buf);
+}
+
+void vsfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (ino == ROOT_INO) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    char name[MAX_NAMESIZE + 1];
+    int fd = name_of(INO_ID(ino), name);
+    if (fd == 0)
+        fd = vs_open(fs, name);
+    if (fd < 0) {
+        fuse_reply_err(req, errno_of(fd));
+        return;
+    }
+    fi->fh = fd;
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+void vsfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    int err = vs_close(fs, fi->fh);
+    fuse_reply_err(req, err < 0 ? errno_of(err) : 0);
+}
+
+void vsfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    if (off >= INT_MAX) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    if ((off_t)size > INT_MAX - off)
+        size = INT_MAX - off;
+
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    int n = vs_read(fs, fi->fh, off, size, buf);
+    if (n < 0)
+        fuse_reply_err(req, errno_of(n));
+    else
+        fuse_reply_buf(req, buf, n);
+    free(buf);
+}
+
+void vsfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    if (off + (off_t)size > INT_MAX) {
+        fuse_reply_err(req, EFBIG);
+        return;
+    }
+
+    //nothing written at all means the image is full
+    int n = vs_write(fs, fi->fh, off, size, (char *)buf);
+    if (n < 0)
+        fuse_reply_err(req, errno_of(n));
+    else if (n == 0 && size > 0)
+        fuse_reply_err(req, ENOSPC);
+    else
+        fuse_reply_write(req, n);
+}
+
+void vsfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    if (parent != ROOT_INO) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if (!valid_name(name)) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+    if (!S_ISREG(mode)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    int err = vs_create(fs, (char *)name);
+    int id = err < 0 ? err : vs_lookup(fs, (char *)name);
+    int fd = id < 0 ? id : vs_open(fs, (char *)name);
+    if (fd < 0) {
+        fuse_reply_err(req, errno_of(fd));
+        return;
+    }
+    remember_name(id, name);
+
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = ID_INO(id);
+    e.attr_timeout = CACHE_TIMEOUT;
+    e.entry_timeout = CACHE_TIMEOUT;
+    fill_attr(e.ino, &e.attr);
+    fi->fh = fd;
+    fi->keep_cache = 1;
+    fuse_reply_create(req, &e, fi);
+}
+
+void vsfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+    if (ino == ROOT_INO) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    if (newparent != ROOT_INO) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if (!valid_name(newname)) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+
+    char name[MAX_NAMESIZE + 1];
+    int err = name_of(INO_ID(ino), name);
+    if (err == 0)
+        err = vs_link(fs, name, (char *)newname);
+    if (err < 0) {
+        fuse_reply_err(req, errno_of(err));
+        return;
+    }
+    reply_entry(req, INO_ID(ino));
+}
+
+void vsfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (parent != ROOT_INO) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if (!valid_name(name)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    int err = vs_unlink(fs, (char *)name);
+    fuse_reply_err(req, err < 0 ? errno_of(err) : 0);
+}
+
+//a link under the new name and unlink of the old one, not atomic
+void vsfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+                 const char *newname, unsigned int flags) {
+    if (parent != ROOT_INO || newparent != ROOT_INO) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if (flags & ~RENAME_NOREPLACE) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if (!valid_name(name) || !valid_name(newname)) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+
+    pthread_mutex_lock(&rename_lock);
+    vs_batch_begin(fs);
+    int id = vs_lookup(fs, (char *)name);
+    int err = id < 0 ? id : 0;
+    int old = vs_lookup(fs, (char *)newname);
+    if (err == 0 && old == id)
+        err = 1;
+    else if (err == 0 && old >= 0)
+        err = (flags & RENAME_NOREPLACE) ? -EXIST_ERR : vs_unlink(fs, (char *)newname);
+    if (err == 0)
+        err = vs_link(fs, (char *)name, (char *)newname);
+    if (err == 0)
+        err = vs_unlink(fs, (char *)name);
+    if (vs_batch_commit(fs) < 0 && err >= 0)
+        err = -WRITE_ERR;
+    pthread_mutex_unlock(&rename_lock);
+    if (err == 0)
+        remember_name(id, newname);
+    fuse_reply_err(req, err < 0 ? errno_of(err) : 0);
+}
+
+void vsfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    pthread_mutex_lock(&rename_lock);
+    int err = vs_sync(fs);
+    pthread_mutex_unlock(&rename_lock);
+    fuse_reply_err(req, err < 0 ? errno_of(err) : 0);
+}
+
+void vsfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, 0);
+}
+
+void vsfs_statfs(fuse_req_t req, fuse_ino_t ino) {
+    struct vs_statfs st;
+    struct statvfs sv;
+    vs_statfs(fs, &st);
+    memset(&sv, 0, sizeof(sv));
+    sv.f_bsize = st.block_size;
+    sv.f_frsize = st.block_size;
+    sv.f_blocks = st.blocks;
+    sv.f_bfree = st.blocks_free;
+    sv.f_bavail = st.blocks_free;
+    sv.f_files = st.files;
+    sv.f_ffree = st.files_free < st.names_free ? st.files_free : st.names_free;
+    sv.f_favail = sv.f_ffree;
+    sv.f_namemax = MAX_NAMESIZE;
+    fuse_reply_statfs(req, &sv);
+}
+
+struct fuse_lowlevel_ops vsfs_ops = {
+    .init = vsfs_init,
+    .lookup = vsfs_lookup,
+    .getattr = vsfs_getattr,
+    .setattr = vsfs_setattr,
+    .readdir = vsfs_readdir,
+    .open = vsfs_open,
+    .release = vsfs_release,
+    .read = vsfs_read,
+    .write = vsfs_write,
+    .create = vsfs_create,
+    .link = vsfs_link,
+    .unlink = vsfs_unlink,
+    .rename = vsfs_rename,
+    .fsync = vsfs_fsync,
+    .flush = vsfs_flush,
+    .statfs = vsfs_statfs
+};
+
+//first argument that is not an option is the image, the next one the mountpoint
+int image_arg(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    if (key == FUSE_OPT_KEY_NONOPT && image == NULL) {
+        image = strdup(arg);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    if (fuse_opt_parse(&args, NULL, NULL, image_arg) != 0 || fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+    if (opts.show_help || image == NULL || opts.mountpoint == NULL) {
+        printf("Usage: %s [options] image mountpoint\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        return opts.show_help ? 0 : 1;
+    }
+    if (opts.show_version) {
+        fuse_lowlevel_version();
+        return 0;
+    }
+
+    int err = vs_mount(image, &fs);
+    if (err < 0) {
+        if (err == -OPEN_ERR) fprintf(stderr, "Error: Unable to open image\n");
+        else if (err == -MARKER_ERR) fprintf(stderr, "Error: Not a VSFS image\n");
+        else fprintf(stderr, "Error: Unable to mount image\n");
+        return 1;
+    }
+    struct vs_statfs st;
+    vs_statfs(fs, &st);
+    nnames = st.files;
+    names = calloc(nnames, sizeof(*names));
+
+    int ret = 1;
+    struct fuse_session *se = fuse_session_new(&args, &vsfs_ops, sizeof(vsfs_ops), NULL);
+    if (se != NULL && fuse_set_signal_handlers(se) == 0) {
+        if (fuse_session_mount(se, opts.mountpoint) == 0) {
+            fuse_daemonize(opts.foreground);
+            if (opts.singlethread) {
+                ret = fuse_session_loop(se);
+            } else {
+                struct fuse_loop_config config = {
+                    .clone_fd = opts.clone_fd,
+                    .max_idle_threads = opts.max_idle_threads
+                };
+                ret = fuse_session_loop_mt(se, &config);
+            }
+            fuse_session_unmount(se);
+        }
+        fuse_remove_signal_handlers(se);
+    }
+    if (se != NULL)
+        fuse_session_destroy(se);
+
+    if (vs_umount(fs) < 0) {
+        fprintf(stderr, "Error: Unable to write in image\n");
+        ret = 1;
+    }
+    free(names);
+    free(opts.mountpoint);
+    free(image);
+    fuse_opt_free_args(&args);
+    return ret ? 1 : 0;
+}
@@ -1,14 +1,142 @@
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+//the kernel headers pulled in by io_uring.h have their own BLOCK_SIZE
+#undef BLOCK_SIZE
 
 #include "vsfs.h"
 #include "vsfs-errors.h"
 
 const char *start_marker = "VSFSIMG\0";
+const char *extents_marker = "VSFSIM2\0";
+const char *journal_marker = "VSFSIMJ\0";
+const char *aligned_marker = "VSFSIM3\0";
+const char *journal_magic = "VSFSJRNL";
+
+/*
+  Block mapping. Format version 1 (start_marker) maps file blocks through
+  blocks_map with the last entry used as a single indirect block.
+  Version 2 (extents_marker) describes a file by extents in logical order:
+  the first FILE_EXTENTS are kept in the fstat, the rest in a chain of
+  extent blocks starting at ext_block, each holding a header followed by
+  as many extents as fit in the block. Images with journal_marker are
+  version 2 images followed by a metadata journal (see journal_commit).
+  Version 3 images (aligned_marker) map blocks as version 2 does, but lay
+  out their regions differently (see struct superblock).
+*/
+#define FORMAT_BLOCKMAP 1
+#define FORMAT_EXTENTS 2
+
+//regions of version 3 images start at multiples of this and of the block size
+#define FORMAT_ALIGN 4096
+#define ROUND_UP(x, align) (((x) + (align) - 1) / (align) * (align))
+
+//superblock flags
+#define SB_JOURNAL 1
+#define SB_CLEAN 2
+
+//vs_mount_ex flag used by vs_fsck without VS_FSCK_REPAIR: the image is opened
+//read-only and journal replay goes to an overlay in memory (see journal_put)
+#define MOUNT_RDONLY 0x100
+
+//number of free runs alloc_run looks at before settling for the longest one
+#define ALLOC_SCAN_RUNS 64
+
+//default amount of memory taken by buffer cache frames
+#define BUF_CACHE_SIZE (1024 * 1024)
+
+//size of the buffer vs_mkfs_ex writes tables with
+#define MKFS_CHUNK (64 * 1024)
+
+//journal takes 1/16 of the image unless its size is given to vs_mkfs_ex
+#define JOURNAL_MIN_SIZE (16 * 1024)
+#define JOURNAL_MAX_SIZE (32 * 1024 * 1024)
+
+//number of namespace locks, a power of two
+#define NS_LOCK_STRIPES 16
+
+//descriptor is an index into the descriptor table with the generation of
+//the entry above DESCR_INDEX_BITS, the table grows by DESCR_SEG_SIZE entries
+#define DESCR_INDEX_BITS 16
+#define DESCR_INDEX_MASK ((1 << DESCR_INDEX_BITS) - 1)
+#define DESCR_GEN_MASK 0x7fff
+#define DESCR_SEG_SIZE MAX_FILES_OPENED
+#define DESCR_MAX_SEGS ((1 << DESCR_INDEX_BITS) / DESCR_SEG_SIZE)
+#define DESCR_NONE 0xffffffffu
+
+//readahead window of sequential reads, starts at READAHEAD_MIN bytes and doubles
+//up to READAHEAD_MAX, but never takes more than a quarter of the buffer cache
+#define READAHEAD_MIN (16 * 1024)
+#define READAHEAD_MAX (256 * 1024)
+
+//appends are buffered up to DELALLOC_SIZE bytes (at least a block) per file
+//before blocks are allocated for them, DELALLOC_MAX bytes for all files together
+#define DELALLOC_SIZE (64 * 1024)
+#define DELALLOC_MAX (4 * 1024 * 1024)
+
+//data of a file being defragmented is copied in pieces of this size (at least a block)
+#define DEFRAG_CHUNK (256 * 1024)
+
+//threads running asynchronous requests when io_uring is not used
+#define AIO_WORKERS 4
+//submission queue entries of the io_uring, the completion queue is twice as big
+#define AIO_RING_ENTRIES 256
+//image reads of a request collected before they are put on the ring
+#define AIO_PIECES 32
+
+//piece of the inode table vs_fsck reads at once, most threads it runs
+#define FSCK_CHUNK (4 * 1024 * 1024)
+#define FSCK_MAX_THREADS 64
+
+/*
+  Operation counters. With VSFS_STATS an instrumented call takes a probe on
+  entry (STATS_BEGIN) and adds its time, bytes and the image I/O calls made
+  meanwhile by its thread to fs->stats on return (STATS_END). Without it the
+  macros are empty and nothing is counted.
+*/
+#ifdef VSFS_STATS
+#define STATS_BEGIN(p) struct stats_probe p; stats_begin(&p)
+#define STATS_END(fs, p, op, bytes, failed) stats_end(fs, &p, op, bytes, failed)
+#define STATS_SYSCALL() (stats_syscalls++)
+#else
+#define STATS_BEGIN(p)
+#define STATS_END(fs, p, op, bytes, failed)
+#define STATS_SYSCALL()
+#endif
+
+#define JTXN_MAGIC 0x4a54584e
+//record offset of a list of freed blocks
+#define JREC_REVOKE -1
+
+#ifdef VSFS_STATS
+struct stats_probe {
+    struct timespec start;
+    long syscalls;
+};
+
+//image I/O calls made by the thread so far
+__thread long stats_syscalls;
+#endif
+
+struct ext_block_header {
+    int next;
+    int count;
+};
 
 struct header {
     int dev_size;
@@ -17,198 +145,1153 @@ struct header {
     int nfiles_max;
 };
 
-int dev_id;
-struct header h;
-int descrs_tab[MAX_FILES_OPENED];
+/*
+  Superblock of version 3 images, alone in the first aligned piece of the
+  image, with marker and header where older versions have them. Regions
+  follow it each starting at a multiple of align (FORMAT_ALIGN or the block
+  size if bigger): the bitmap packed into 64-bit words with a bit set for
+  each used block, the inode table, the directory table, the data area and
+  the journal, whose transactions start on pages too. Metadata is read and
+  written in whole pages (see dev_unaligned), so the image works with
+  O_DIRECT as far as metadata goes. Older versions pack a bitmap of one
+  byte per block and the tables right after the header, unaligned. Offsets
+  are kept here for other tools to find the regions; the library computes
+  them (layout_regions) and only checks they agree. SB_CLEAN is cleared at
+  mount and set again at umount together with the free counters, so that
+  mounting a cleanly unmounted image needs no scan of the inode table.
+*/
+struct superblock {
+    char marker[8];
+    struct header h;
+    int flags;          //SB_* flags
+    int align;
+    int64_t bitmap_offset;
+    int64_t fstattab_offset;
+    int64_t dirtab_offset;
+    int64_t blocks_offset;
+    int64_t journal_offset;
+    int64_t journal_size;
+    int blocks_free;    //free blocks and inodes, valid with SB_CLEAN
+    int files_free;
+    uint32_t crc;       //crc32 of the fields before it
+};
+
+//one stripe of the namespace lock, kept on its own cache line. The rwlock
+//lets readers in while others hold it, so a writer holds gate while it
+//waits and new readers queue behind it instead of starving it
+struct ns_lock {
+    pthread_rwlock_t lock;
+    pthread_mutex_t gate;
+} __attribute__((aligned(64)));
+
+//first bytes of the journal region, size includes this header
+struct journal_header {
+    char magic[8];
+    int size;
+    int seq;
+};
+
+//transaction in the journal log, followed by len bytes of records
+struct journal_txn {
+    uint32_t magic;
+    int seq;
+    int len;
+    uint32_t crc;
+};
 
-int next_descriptor();
-int next_free_block();
-int occupy_block(int i);
+//record of a transaction, followed by len bytes of data padded to 8 bytes
+struct journal_rec {
+    int64_t offset;
+    int len;
+    int pad;
+};
 
-int occupy_next_block();
-int get_fstattab_offset();
-int get_dirtab_offset();
-int get_blocks_offset();
-int read_dirtab(struct dir_rec *dirtab);
-int read_fstattab(struct fstat *fstattab);
-int write_fstat(struct fstat *stat, int id);
-int write_dir_rec(struct dir_rec *dirrec, int i);
-int get_block_id(struct fstat *stat, int block_offset, int create);
-int free_block(int blockid);
-int free_all_under_from(int blockid, int start);
+/*
+  Inode cache: fstat of every opened file is kept in memory and changes only
+  mark the entry dirty. Dirty entries are written back when the last
+  descriptor is closed, on vs_sync and on vs_umount. Entries are chained
+  in buckets by id.
+*/
+struct inode {
+    int id;
+    int nopen;
+    int dirty;
+    struct fstat stat;
+    struct inode *next;
 
+    //taken shared by vs_read and vs_getstat, exclusively by vs_write
+    pthread_rwlock_t lock;
 
-int vs_mkfs(char *filename, int dev_size){
-    dev_id = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    //all extents of the file and blocks of its extent chain (version 2 only)
+    struct extent *ext;
+    int next_ext;
+    int ext_cap;
+    int ext_dirty;
+    int *chain;
+    int nchain;
 
-    if (dev_id < 0) return -CREATE_ERR;
+    //index and first logical block of the extent bmap_lookup found last,
+    //reset whenever extents before the end of the list change
+    uint64_t ext_hint;
 
-    if (write(dev_id, start_marker, sizeof(start_marker)) < 0)
-        return -WRITE_ERR;
+    //appended data without blocks yet: da_len bytes from the start of logical
+    //block da_block, da_nres blocks of the image are reserved for them
+    char *da_buf;
+    int da_block;
+    int da_len;
+    int da_nres;
+};
+
+//entry of the descriptor table, id -1 if unused
+struct descr {
+    int id;
+    uint32_t gen;           //bumped on close
+    struct inode *ino;      //cached inode of the file, its fstat is used without a lookup
+    int pos;                //position of vs_seq_read, vs_seq_write and vs_seek
+    uint32_t next_free;     //next entry of the free stack
+
+    //readahead state, see readahead
+    int ra_next;            //offset a sequential read would start at
+    int ra_window;          //blocks read ahead last time, 0 if reads are not sequential
+    int ra_end;             //logical block the blocks read ahead end at
+};
+
+//io_uring queues shared with the kernel, see ring_setup
+struct aio_ring {
+    int fd;
+    unsigned sq_entries;
+    unsigned cq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+//image read of an asynchronous request
+struct aio_piece {
+    char *dst;
+    int len;
+    off_t offset;
+};
+
+//frame of the buffer cache holding one block of the data area, blockid -1 if unused
+struct buf {
+    int blockid;
+    int ref;
+    int dirty;
+    int meta;   //indirect or extent block, written back through the journal
+    char *data;
+    struct buf *next;
+};
+
+//state of one mounted image, all image I/O is positional
+struct vsfs {
+    int dev_id;
+    int version;
+    struct header h;
+
+    //version 3 layout, offsets of the regions set by layout_regions
+    int aligned;
+    off_t bitmap_offset;
+    off_t fstattab_offset;
+    off_t dirtab_offset;
+    off_t blocks_offset;
+
+    //version 3 image was unmounted cleanly, free counters it was left with
+    int clean;
+    int clean_blocks_free;
+    int clean_files_free;
+
+    //whole image mapped with MAP_SHARED when mounted with VS_MOUNT_MMAP, NULL otherwise
+    char *dev_map;
+    off_t dev_map_size;
+
+    /*
+      Descriptor table is made of segments that are never moved or freed
+      before umount, so entries are used without a lock. Unused entries form
+      a lock-free stack: descr_head holds the top index in its low half and
+      a tag bumped by every change in its high half, so that a compare and
+      swap based on a stale head fails. Only adding a segment takes
+      descr_grow_lock. A closed descriptor is refused even once its entry is
+      reused, as the entry generation no longer matches.
+    */
+    struct descr *descr_segs[DESCR_MAX_SEGS];
+    int ndescrs;
+    uint64_t descr_head;
+    pthread_mutex_t descr_grow_lock;
+
+    /*
+      Locking. Calls changing the namespace or more than one file (create,
+      link, unlink, truncate, sync, batches, journal commits) take every
+      stripe of ns_locks exclusively and run alone. The rest take a single
+      stripe shared, picked by name hash or descriptor, so that concurrent
+      lookups and reads don't contend on one lock word. vs_close takes the
+      stripe of its descriptor exclusively instead. Within them:
+        - the inode rwlock for the file data and fstat,
+        - icache_lock for the inode cache, open counts and ino_free,
+        - alloc_lock for the block bitmap and jfree,
+        - buf_lock (recursive) for the buffer cache,
+        - jlock for the open journal transaction,
+        - aio_lock for asynchronous requests,
+        - dev_lock for partially written pages of version 3 metadata,
+      taken in this order. Calls running alone still take the inner mutexes
+      where they share code with the others.
+    */
+    struct ns_lock ns_locks[NS_LOCK_STRIPES];
+    pthread_mutex_t icache_lock;
+    pthread_mutex_t alloc_lock;
+    pthread_mutex_t buf_lock;
+    pthread_mutex_t jlock;
+    pthread_mutex_t dev_lock;
+
+    /*
+      Free blocks bitmap is kept in memory from mount till umount packed into
+      64-bit words (bit set = block occupied). Blocks in [dirty_lo, dirty_hi)
+      were changed since last flush and get written back on sync/umount.
+      Scanning for free blocks starts from bitmap_hint block.
+    */
+    uint64_t *bitmap;
+    int bitmap_nwords;
+    int bitmap_nfree;
+    int bitmap_hint;
+    int bitmap_dirty_lo;
+    int bitmap_dirty_hi;
+
+    //blocks reserved for and memory taken by append buffers of all files (see da_write)
+    int da_reserved;
+    long da_bytes;
+
+    /*
+      Directory table is also loaded at mount. dir_index is an open addressing
+      (linear probing) hash table of dirtab slots keyed by file name, -1 marks
+      an empty cell. dir_free is a stack of unused dirtab slots.
+    */
+    struct dir_rec *dirtab;
+    int *dir_index;
+    int dir_index_mask;
+    int *dir_free;
+    int dir_nfree;
+
+    /*
+      Between vs_batch_begin and vs_batch_commit directory records are only
+      changed in dirtab with [dir_dirty_lo, dir_dirty_hi) tracking what to
+      write back, and inodes stay cached (dirty) until the commit.
+    */
+    int batch;
+    int dir_dirty_lo;
+    int dir_dirty_hi;
+
+    /*
+      Metadata journal of journal_marker images, placed right after the data
+      area. Metadata writes are collected in the open transaction jbuf and
+      reach the image only when it is committed, reads of metadata see them
+      through meta_read. Blocks freed within the open transaction (jfree)
+      are released to the bitmap only when it commits.
+    */
+    int journal;
+    off_t jstart;
+    int jsize;
+    int jhead;
+    int jseq;
+    char *jbuf;
+    int jlen;
+    int jtaken;         //jlen before blocks are released by journal_commit
+    int jcap;
+    int rdonly;
+    char *overlay;      //records replayed on a read-only mount, laid over dev_read
+    int overlay_len;
+    int overlay_cap;
+    int *jfree;
+    int jnfree;
+    int jfree_cap;
+
+    /*
+      Asynchronous requests (vs_aio_*). With io_uring a read is turned into
+      image reads put on the ring at submission, one per physically
+      contiguous run of blocks missing from the buffer cache, the rest of
+      the request is served at once from the cache. Writes are done at
+      submission, they mostly only fill the buffer cache. Otherwise
+      aio_workers run requests taken from aio_queue with the synchronous
+      calls. Finished requests wait in aio_done till they are collected.
+      aio_inflight counts reads handed to the kernel; before a block may be
+      reused aio_drain waits for them, so a late read never lands data of
+      another file. Only one thread at a time (ring_waiting) sleeps on the
+      ring, the others wait on aio_done_cond.
+    */
+    int aio_mode;
+    pthread_mutex_t aio_lock;
+    pthread_cond_t aio_queue_cond;
+    pthread_cond_t aio_done_cond;
+    int aio_event_fd;
+    struct vs_aio *aio_queue;
+    struct vs_aio *aio_queue_tail;
+    struct vs_aio *aio_done;
+    struct vs_aio *aio_done_tail;
+    int aio_outstanding;
+    int aio_inflight;
+    int aio_stop;
+    pthread_t aio_workers[AIO_WORKERS];
+    int naio_workers;
+    struct aio_ring ring;
+    int ring_waiting;
+
+    struct inode *inode_buckets[MAX_FILES_OPENED];
+
+    /*
+      Stack of unused inode ids built at mount from the inode table, an id is
+      pushed back when the last link and descriptor of its file are gone.
+    */
+    int *ino_free;
+    int ino_nfree;
+
+    /*
+      Buffer cache of data area blocks: file data, indirect and extent blocks.
+      Frames are found through buf_hash chained by block id and replaced with
+      CLOCK: every access sets ref, buf_hand clears it on its way until it
+      meets an unreferenced frame. Dirty frames are written back on eviction,
+      vs_sync and vs_umount, together with dirty frames of adjacent blocks.
+    */
+    struct buf *bufs;
+    int nbufs;
+    int buf_hand;
+    struct buf **buf_hash;
+    int buf_hash_mask;
+    struct vs_cache_stats cache_stats;
+
+#ifdef VSFS_STATS
+    //updated with atomic adds by every thread, see STATS_BEGIN
+    struct vs_op_stats stats[VS_NOPS];
+#endif
+};
+
+//state of vs_fsck shared by its threads
+struct fsck {
+    struct vsfs *fs;
+    int repair;
+    int err;
+
+    //blocks used by files, and those used more than once, as in fs->bitmap
+    uint64_t *seen;
+    uint64_t *shared;
+
+    //directory records of each inode, -1 for unused inodes having some
+    int *nrefs;
+
+    //free directory records left for orphans and orphans to link, under lock
+    int nslots;
+    int *orphans;
+    int norphans;
+    pthread_mutex_t lock;
+    struct vs_fsck_report report;
+};
+
+//inodes of the table chunk at stats checked by one thread
+struct fsck_job {
+    struct fsck *c;
+    struct fstat *stats;
+    int base;           //id of stats[0]
+    int first;
+    int n;
+    pthread_t thread;
+};
+
+int format_image(struct vsfs *fs, int flags);
+int mount_image(struct vsfs *fs, int flags);
+int read_superblock(struct vsfs *fs, struct superblock *sbp);
+void fill_superblock(struct vsfs *fs, struct superblock *sb);
+int write_superblock(struct vsfs *fs);
+void layout_regions(struct vsfs *fs);
+int valid_block_size(int block_size);
+int dev_read(struct vsfs *fs, void *buf, int size, off_t offset);
+int dev_write(struct vsfs *fs, void *buf, int size, off_t offset);
+int dev_unaligned(struct vsfs *fs, void *buf, int size, off_t offset);
+int dev_bounce_read(struct vsfs *fs, void *buf, int size, off_t offset);
+int dev_bounce_write(struct vsfs *fs, void *buf, int size, off_t offset);
+int dev_sync(struct vsfs *fs);
+void dev_advise(struct vsfs *fs, off_t offset, off_t len);
+int meta_read(struct vsfs *fs, void *buf, int size, off_t offset);
+void overlay_recs(char *recs, int len, void *buf, int n, off_t offset);
+int meta_write(struct vsfs *fs, void *buf, int size, off_t offset);
+struct descr *descr_at(struct vsfs *fs, int index);
+struct descr *descr_get(struct vsfs *fs, int fd);
+int descr_fd(struct descr *d, int index);
+int descr_pop(struct vsfs *fs);
+void descr_push(struct vsfs *fs, int first, struct descr *last);
+int descr_grow(struct vsfs *fs);
+void descr_table_free(struct vsfs *fs);
+int descr_read(struct vsfs *fs, int fd, int offset, int size, char *buffer, int seq);
+int descr_write(struct vsfs *fs, int fd, int offset, int size, char *buffer, int seq);
+void readahead(struct vsfs *fs, struct descr *d, int offset, int len);
+void prefetch(struct vsfs *fs, struct inode *ino, int lblock, int nblocks, int hint);
+int aio_setup(struct vsfs *fs, int mode);
+void aio_shutdown(struct vsfs *fs);
+void *aio_worker(void *arg);
+void aio_complete(struct vsfs *fs, struct vs_aio *req, int notify);
+void aio_wait_done(struct vsfs *fs);
+void aio_drain(struct vsfs *fs);
+int ring_setup(struct vsfs *fs);
+void ring_free(struct vsfs *fs);
+int ring_read(struct vsfs *fs, struct vs_aio *req);
+void ring_queue(struct vsfs *fs, struct vs_aio *req, struct aio_piece *pieces, int n);
+void ring_submit(struct vsfs *fs, int n);
+void ring_reap(struct vsfs *fs);
+void locks_init(struct vsfs *fs);
+void locks_destroy(struct vsfs *fs);
+void ns_lock_shared(struct vsfs *fs, unsigned int key);
+void ns_unlock_shared(struct vsfs *fs, unsigned int key);
+void ns_lock_exclusive(struct vsfs *fs, unsigned int key);
+void ns_unlock_exclusive(struct vsfs *fs, unsigned int key);
+void ns_lock_all(struct vsfs *fs);
+void ns_unlock_all(struct vsfs *fs);
+int create_file(struct vsfs *fs, char *pathname);
+int open_file(struct vsfs *fs, char *pathname);
+int close_file(struct vsfs *fs, int fd);
+int read_file(struct vsfs *fs, struct inode *ino, int offset, int size, char *buffer);
+int write_file(struct vsfs *fs, struct inode *ino, int offset, int size, char *buffer);
+int write_blocks(struct vsfs *fs, struct inode *ino, int offset, int size, char *buffer);
+int da_write(struct vsfs *fs, struct inode *ino, int offset, int size, char *buffer);
+int da_reserve(struct vsfs *fs, struct inode *ino, int len);
+int da_flush(struct vsfs *fs, struct inode *ino);
+void da_trim(struct vsfs *fs, struct inode *ino, int size);
+void da_read(struct vsfs *fs, struct inode *ino, int offset, int len, char *buffer);
+int link_file(struct vsfs *fs, char *src_pathname, char *dest_pathname);
+int unlink_file(struct vsfs *fs, char *pathname);
+int truncate_file(struct vsfs *fs, char *pathname, int size);
+int frag_walk(struct vsfs *fs, char *pathname, int flags, int defrag, struct vs_frag *frag);
+int frag_file(struct vsfs *fs, int id, int flags, int defrag, struct vs_frag *frag);
+int file_runs(struct vsfs *fs, struct inode *ino, int *nblocks, int *first);
+int defrag_file(struct vsfs *fs, struct inode *ino, int flags);
+int find_free_run(struct vsfs *fs, int want, int limit);
+int sync_image(struct vsfs *fs);
+int batch_commit(struct vsfs *fs);
+int read_stat(struct vsfs *fs, int id, struct fstat *stat);
+int find_free_block(struct vsfs *fs, int from, int to);
+int free_run_length(struct vsfs *fs, int i, int max);
+void occupy_run(struct vsfs *fs, int start, int len);
+int alloc_run(struct vsfs *fs, int want, int goal, int *got);
+int load_bitmap(struct vsfs *fs);
+int flush_bitmap(struct vsfs *fs);
+void mark_bitmap_dirty(struct vsfs *fs, int i);
+int load_dirtab(struct vsfs *fs);
+int load_free_inodes(struct vsfs *fs);
+unsigned int dir_hash(char *name);
+int dir_lookup(struct vsfs *fs, char *name);
+void dir_index_insert(struct vsfs *fs, int slot);
+void dir_index_remove(struct vsfs *fs, int slot);
+int dir_alloc_slot(struct vsfs *fs);
+void dir_release_slot(struct vsfs *fs, int slot);
+struct inode *inode_find(struct vsfs *fs, int id);
+struct inode *inode_alloc(int id, struct fstat *stat);
+void inode_insert(struct vsfs *fs, struct inode *ino);
+struct inode *inode_get(struct vsfs *fs, int id);
+int inode_put(struct vsfs *fs, struct inode *ino);
+int inode_cmp(const void *a, const void *b);
+int flush_inodes(struct vsfs *fs);
+int flush_dirtab(struct vsfs *fs);
+
+int occupy_next_block(struct vsfs *fs);
+off_t get_fstattab_offset(struct vsfs *fs);
+off_t get_dirtab_offset(struct vsfs *fs);
+off_t get_blocks_offset(struct vsfs *fs);
+int read_dirtab(struct vsfs *fs, struct dir_rec *dirtab);
+int read_fstattab(struct vsfs *fs, struct fstat *fstattab);
+int write_fstat(struct vsfs *fs, struct fstat *stat, int id);
+int write_dir_rec(struct vsfs *fs, struct dir_rec *dirrec, int i);
+int get_block_id(struct vsfs *fs, struct fstat *stat, int block_offset, int create);
+int map_block_id(struct vsfs *fs, struct fstat *stat, int block_offset, int create);
+int free_block(struct vsfs *fs, int blockid);
+int free_all_under_from(struct vsfs *fs, int blockid, int start);
+int bmap_lookup(struct vsfs *fs, struct inode *ino, int lblock, int max, int *run);
+int bmap_alloc(struct vsfs *fs, struct inode *ino, int lblock, int want, int *run);
+int bmap_truncate(struct vsfs *fs, struct inode *ino, int nblocks);
+int ext_append(struct inode *ino, int start, int len);
+int load_extents(struct vsfs *fs, struct inode *ino);
+int store_extents(struct vsfs *fs, struct inode *ino);
+int buf_init(struct vsfs *fs, int nframes);
+void buf_free(struct vsfs *fs);
+struct buf *buf_find(struct vsfs *fs, int blockid);
+struct buf *buf_get(struct vsfs *fs, int blockid, int load);
+struct buf *buf_victim(struct vsfs *fs);
+void buf_insert(struct vsfs *fs, struct buf *b, int blockid);
+void buf_invalidate(struct vsfs *fs, int blockid);
+int buf_writeback(struct vsfs *fs, struct buf *b);
+int buf_flush(struct vsfs *fs);
+int buf_flush_range(struct vsfs *fs, int blockid, int nblocks);
+int buf_read(struct vsfs *fs, int blockid, int nblocks, int byte_offset, int len, char *dst);
+int buf_write(struct vsfs *fs, int blockid, int nblocks, int byte_offset, int len, char *src, int fresh);
+int zero_tail(struct vsfs *fs, struct inode *ino, int size);
+int ext_fill(struct inode *ino, int lblock, int start, int len);
+uint32_t crc32(const void *data, int len);
+int journal_load(struct vsfs *fs);
+int journal_replay(struct vsfs *fs);
+char *journal_read_txn(struct vsfs *fs, int pos, int seq, struct journal_txn *txn);
+int journal_log(struct vsfs *fs, int64_t offset, void *data, int len);
+int journal_pending(struct vsfs *fs);
+int journal_check(struct vsfs *fs);
+int journal_check_shared(struct vsfs *fs, unsigned int key);
+int journal_commit(struct vsfs *fs);
+int journal_commit_split(struct vsfs *fs);
+int journal_write_txn(struct vsfs *fs, char *buf, int len);
+int journal_apply(struct vsfs *fs, char *recs, int len, int *revoked, int nrevoked, int seq);
+int journal_put(struct vsfs *fs, void *data, int len, off_t offset);
+int revoke_cmp(const void *a, const void *b);
+int journal_checkpoint(struct vsfs *fs);
+int journal_align(struct vsfs *fs, int pos);
+void journal_free(struct vsfs *fs);
+int fsck_inodes(struct fsck *c, int nthreads);
+void *fsck_worker(void *arg);
+void fsck_inode(struct fsck *c, int id, struct fstat *st, char *block, struct vs_fsck_report *r);
+int fsck_blockmap(struct fsck *c, struct fstat *st, int nblocks, char *block, struct vs_fsck_report *r);
+int fsck_extents(struct fsck *c, struct fstat *st, int nblocks, char *block, struct vs_fsck_report *r);
+int fsck_extent(struct fsck *c, struct extent *e, long long *lblock, int nblocks, struct vs_fsck_report *r);
+int fsck_ref(struct fsck *c, int blockid, int lblock, int nblocks, struct vs_fsck_report *r);
+void fsck_mark(struct fsck *c, int blockid);
+void fsck_dirtab(struct fsck *c);
+void fsck_bitmap(struct fsck *c);
+#ifdef VSFS_STATS
+void stats_begin(struct stats_probe *p);
+void stats_end(struct vsfs *fs, struct stats_probe *p, int op, long bytes, int failed);
+#endif
+
+
+int vs_mkfs(char *filename, int dev_size) {
+    return vs_mkfs_ex(filename, dev_size, NULL);
+}
+
+int vs_mkfs_ex(char *filename, off_t dev_size, struct vs_mkfs_opts *opts) {
+    struct vsfs fs;
+    int block_size = BLOCK_SIZE;
+    int flags = 0;
+    if (opts != NULL) {
+        if (opts->block_size != 0)
+            block_size = opts->block_size;
+        flags = opts->flags;
+    }
+
+    if (!valid_block_size(block_size))
+        return -BLOCKSIZE_ERR;
 
     /*
       Total number or blocks for files in an image for chosen dev_size
       Considering that image consists of the:
-      marker, header, free blocks bitmap, inode table, root directory table and file blocks
+      superblock, free blocks bitmap, inode table, root directory table and file blocks
       max number of files is taken as equal to nblocks/2
     */
-    int nblocks = (dev_size - sizeof(start_marker) - sizeof(struct header) - sizeof(struct dir_rec))
-        / (BLOCK_SIZE + sizeof(char) + sizeof(struct fstat)/2 + sizeof(struct dir_rec)/2);
+    //journal is taken off the end of the image first
+    off_t journal_size = 0;
+    if (!(flags & VS_MKFS_NOJOURNAL)) {
+        journal_size = dev_size / 16;
+        if (journal_size < JOURNAL_MIN_SIZE) journal_size = JOURNAL_MIN_SIZE;
+        if (journal_size > JOURNAL_MAX_SIZE) journal_size = JOURNAL_MAX_SIZE;
+        if (opts != NULL && opts->journal_size != 0)
+            journal_size = opts->journal_size;
+        //so that the image ends on a page
+        journal_size = journal_size / FORMAT_ALIGN * FORMAT_ALIGN;
+        if (journal_size < JOURNAL_MIN_SIZE || journal_size > INT_MAX)
+            return -SIZE_ERR;
+    }
+
+    //superblock and padding in front of the five other regions, a bit per block in the bitmap
+    off_t align = block_size > FORMAT_ALIGN ? block_size : FORMAT_ALIGN;
+    off_t overhead = 6 * align + sizeof(uint64_t) + sizeof(struct dir_rec) + journal_size;
+    if (dev_size < overhead)
+        return -SIZE_ERR;
+    off_t nblocks = (dev_size - overhead) * 8
+        / (8 * (block_size + sizeof(struct fstat)/2 + sizeof(struct dir_rec)/2) + 1);
+
+    //tables are read and written with a single int sized call
+    off_t max_nblocks = INT_MAX / sizeof(struct dir_rec);
+    if (nblocks > max_nblocks)
+        nblocks = max_nblocks;
 
-    if (nblocks < 2) return -SIZE_ERR;
+    memset(&fs, 0, sizeof(fs));
+    fs.aligned = 1;
+    fs.h.dev_size = dev_size < INT_MAX ? dev_size : INT_MAX;
+    fs.h.block_size = block_size;
+    fs.journal = journal_size > 0;
+    fs.jsize = journal_size;
 
-    h.dev_size = dev_size;
-    h.block_size = BLOCK_SIZE;
-    h.nblocks = nblocks;
-    h.nfiles_max = nblocks / 2;
-    if (write(dev_id, &h, sizeof(h)) < 0)
+    //estimate counts all the padding there can be, blocks are added while they fit
+    for (int grow = 1; nblocks >= 2; ) {
+        fs.h.nblocks = nblocks;
+        fs.h.nfiles_max = nblocks / 2;
+        layout_regions(&fs);
+        int fits = fs.jstart + fs.jsize <= dev_size;
+        if (!fits) {
+            nblocks--;
+            grow = 0;
+        } else if (grow && nblocks < max_nblocks) {
+            nblocks++;
+        } else {
+            break;
+        }
+    }
+    if (nblocks < 2)
+        return -SIZE_ERR;
+
+    fs.dev_id = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    if (fs.dev_id < 0) return -CREATE_ERR;
+
+    pthread_mutex_init(&fs.dev_lock, NULL);
+    int err = format_image(&fs, flags);
+    pthread_mutex_destroy(&fs.dev_lock);
+    if (close(fs.dev_id) < 0 && err == 0)
+        err = -CLOSE_ERR;
+    return err;
+}
+
+/*
+  Image is sized with ftruncate, so the bitmap and the data area read as
+  zeros without being written. Tables are written in MKFS_CHUNK sized
+  pieces, unless VS_MKFS_LAZY is set: then they are left zero as well and
+  zero records are taken as unused at mount (see load_dirtab, vs_getstat).
+*/
+int format_image(struct vsfs *fs, int flags) {
+    off_t image_size = fs->jstart + fs->jsize;
+    if (ftruncate(fs->dev_id, image_size) < 0)
         return -WRITE_ERR;
 
-    char *bitmap_buf = malloc(nblocks * sizeof(char));
-    memset(bitmap_buf, 0, nblocks);
-    if (write(dev_id, bitmap_buf, nblocks) < 0) {
-        free(bitmap_buf);
+    if ((flags & VS_MKFS_PREALLOC)
+            && posix_fallocate(fs->dev_id, get_blocks_offset(fs), image_size - get_blocks_offset(fs)) != 0)
         return -WRITE_ERR;
-    }
-    free(bitmap_buf);
 
-    int fstattab_size = h.nfiles_max * sizeof(struct fstat);
-    int dirtab_size = (h.nfiles_max + 1) * sizeof(struct dir_rec);
-    struct fstat *fstat_buf = malloc(fstattab_size);
-    struct dir_rec *dirtab_buf = malloc(dirtab_size);
-    int i;
-    for (i = 0; i < h.nfiles_max; i++) {
-            fstat_buf[i].ftype = -1;
-            fstat_buf[i].nlinks = 0;
-            fstat_buf[i].size = 0;
-            for (int j = 0; j < FILE_BLOCKS; j++)
-                fstat_buf[i].blocks_map[j] = -1;
-
-            dirtab_buf[i].id = -1;
-            for (int j = 0; j < MAX_NAMESIZE; j++)
-                dirtab_buf[i].name[j] = 0;
-    }
-    dirtab_buf[i].id = END_ID;
-    for (int j = 0; j < MAX_NAMESIZE; j++)
-        dirtab_buf[i].name[j] = 0;
+    struct superblock sb;
+    fs->clean = 1;
+    fs->bitmap_nfree = fs->h.nblocks;
+    fs->ino_nfree = fs->h.nfiles_max;
+    fill_superblock(fs, &sb);
+    if (dev_write(fs, &sb, sizeof(sb), 0) < 0)
+        return -WRITE_ERR;
 
-    if (write(dev_id, fstat_buf, fstattab_size) < 0 ||
-            write(dev_id, dirtab_buf, dirtab_size) < 0) {
-        free(fstat_buf);
-        free(dirtab_buf);
+    if (fs->journal) {
+        struct journal_header jh = {
+            .size = fs->jsize,
+            .seq = 1
+        };
+        memcpy(jh.magic, journal_magic, sizeof(jh.magic));
+        if (dev_write(fs, &jh, sizeof(jh), fs->jstart) < 0)
+            return -WRITE_ERR;
+    }
+
+    struct dir_rec endrec = {
+        .id = END_ID
+    };
+    memset(endrec.name, 0, MAX_NAMESIZE);
+    off_t end_offset = get_dirtab_offset(fs) + (off_t)fs->h.nfiles_max * sizeof(struct dir_rec);
+    if (dev_write(fs, &endrec, sizeof(endrec), end_offset) < 0)
         return -WRITE_ERR;
+
+    if (flags & VS_MKFS_LAZY)
+        return 0;
+
+    int per_chunk = MKFS_CHUNK / sizeof(struct fstat);
+    struct fstat *fstat_buf = malloc(per_chunk * sizeof(struct fstat));
+    for (int i = 0; i < per_chunk; i++) {
+        fstat_buf[i].ftype = -1;
+        fstat_buf[i].nlinks = 0;
+        fstat_buf[i].size = 0;
+        for (int j = 0; j < FILE_BLOCKS; j++)
+            fstat_buf[i].blocks_map[j] = -1;
+    }
+    for (int id = 0; id < fs->h.nfiles_max; id += per_chunk) {
+        int n = fs->h.nfiles_max - id < per_chunk ? fs->h.nfiles_max - id : per_chunk;
+        if (dev_write(fs, fstat_buf, n * sizeof(struct fstat),
+                      get_fstattab_offset(fs) + (off_t)id * sizeof(struct fstat)) < 0) {
+            free(fstat_buf);
+            return -WRITE_ERR;
+        }
     }
     free(fstat_buf);
-    free(dirtab_buf);
 
-    int nblocks_size = h.block_size * h.nblocks;
-    char *blocks_buf = calloc(nblocks_size, 1);
-    if (write(dev_id, blocks_buf, nblocks_size) < 0) {
-        free(blocks_buf);
-        return -WRITE_ERR;
+    per_chunk = MKFS_CHUNK / sizeof(struct dir_rec);
+    struct dir_rec *dirtab_buf = calloc(per_chunk, sizeof(struct dir_rec));
+    for (int i = 0; i < per_chunk; i++)
+        dirtab_buf[i].id = -1;
+    for (int i = 0; i < fs->h.nfiles_max; i += per_chunk) {
+        int n = fs->h.nfiles_max - i < per_chunk ? fs->h.nfiles_max - i : per_chunk;
+        if (dev_write(fs, dirtab_buf, n * sizeof(struct dir_rec),
+                      get_dirtab_offset(fs) + (off_t)i * sizeof(struct dir_rec)) < 0) {
+            free(dirtab_buf);
+            return -WRITE_ERR;
+        }
     }
-    free(blocks_buf);
+    free(dirtab_buf);
+
     return 0;
 }
 
-int vs_mount(char *filename) {
-    dev_id = open(filename, O_RDWR, S_IRWXU);
-    if (dev_id < 0) return -OPEN_ERR;
+int vs_mount(char *filename, struct vsfs **fsp) {
+    return vs_mount_ex(filename, 0, fsp);
+}
+
+int vs_mount_ex(char *filename, int flags, struct vsfs **fsp) {
+    struct vsfs *fs = calloc(1, sizeof(struct vsfs));
+    fs->dev_id = open(filename, flags & MOUNT_RDONLY ? O_RDONLY : O_RDWR, S_IRWXU);
+    if (fs->dev_id < 0) {
+        free(fs);
+        return -OPEN_ERR;
+    }
+
+    locks_init(fs);
+    int err = mount_image(fs, flags);
+    if (err < 0) {
+        free(fs->bitmap);
+        free(fs->dirtab);
+        free(fs->dir_index);
+        free(fs->dir_free);
+        free(fs->ino_free);
+        buf_free(fs);
+        journal_free(fs);
+        if (fs->dev_map != NULL)
+            munmap(fs->dev_map, fs->dev_map_size);
+        close(fs->dev_id);
+        descr_table_free(fs);
+        locks_destroy(fs);
+        free(fs);
+        return err;
+    }
+
+    *fsp = fs;
+    return 0;
+}
 
+int mount_image(struct vsfs *fs, int flags) {
     int marker_size = sizeof(start_marker);
-    char *marker = malloc(marker_size);
+    fs->rdonly = (flags & MOUNT_RDONLY) != 0;
 
-    if (read(dev_id, marker, marker_size) < 0) {
+    //first page holds the marker and the header or superblock, it is read whole for O_DIRECT
+    char *marker;
+    if (posix_memalign((void **)&marker, FORMAT_ALIGN, FORMAT_ALIGN) != 0)
+        return -READ_ERR;
+    memset(marker, 0, FORMAT_ALIGN);
+    STATS_SYSCALL();
+    if (pread(fs->dev_id, marker, FORMAT_ALIGN, 0) < marker_size) {
         free(marker);
         return -READ_ERR;
     }
 
-    if (0 != strcmp(marker, start_marker)) {
+    if (0 == strcmp(marker, start_marker)) {
+        fs->version = FORMAT_BLOCKMAP;
+    } else if (0 == strcmp(marker, extents_marker)) {
+        fs->version = FORMAT_EXTENTS;
+    } else if (0 == strcmp(marker, journal_marker)) {
+        fs->version = FORMAT_EXTENTS;
+        fs->journal = 1;
+    } else if (0 == strcmp(marker, aligned_marker)) {
+        fs->version = FORMAT_EXTENTS;
+        fs->aligned = 1;
+    } else {
         free(marker);
         return -MARKER_ERR;
     }
-    free(marker);
 
-    if (read(dev_id, &h, sizeof(struct header)) < 0)
+    //a short image reads as zeros, which no header passes
+    if (fs->aligned) {
+        int err = read_superblock(fs, (struct superblock *)marker);
+        free(marker);
+        if (err < 0)
+            return err;
+    } else {
+        memcpy(&fs->h, marker + marker_size, sizeof(struct header));
+        free(marker);
+        if (!valid_block_size(fs->h.block_size) || fs->h.nblocks < 2)
+            return -MARKER_ERR;
+        layout_regions(fs);
+    }
+
+    if (flags & VS_MOUNT_MMAP) {
+        struct stat st;
+        if (fstat(fs->dev_id, &st) < 0)
+            return -READ_ERR;
+
+        int prot = fs->rdonly ? PROT_READ : PROT_READ | PROT_WRITE;
+        fs->dev_map = mmap(NULL, st.st_size, prot, MAP_SHARED, fs->dev_id, 0);
+        if (fs->dev_map == MAP_FAILED) {
+            fs->dev_map = NULL;
+            return -OPEN_ERR;
+        }
+        fs->dev_map_size = st.st_size;
+    }
+
+    //committed transactions are replayed before any table is read
+    if (fs->journal) {
+        int err = journal_load(fs);
+        if (err < 0)
+            return err;
+    }
+
+    if (load_bitmap(fs) < 0 || load_dirtab(fs) < 0 || load_free_inodes(fs) < 0)
+        return -READ_ERR;
+
+    int nframes = BUF_CACHE_SIZE / fs->h.block_size;
+    if (nframes < VS_CACHE_MIN_FRAMES)
+        nframes = VS_CACHE_MIN_FRAMES;
+    if (buf_init(fs, nframes) < 0)
         return -READ_ERR;
 
-    for (int i = 0; i < MAX_FILES_OPENED; i++)
-        descrs_tab[i] = -1;
+    //counters on the image are stale from the first change on
+    if (fs->aligned && !fs->rdonly) {
+        fs->clean = 0;
+        if (write_superblock(fs) < 0)
+            return -WRITE_ERR;
+    }
+
+    fs->descr_head = DESCR_NONE;
 
     return 0;
 }
 
-int vs_umount() {
-    h.dev_size = -1;
-    h.block_size = -1;
-    h.nblocks = -1;
-    h.nfiles_max = -1;
-    for (int i = 0; i < MAX_FILES_OPENED; i++)
-        if (descrs_tab[i] >= 0) vs_close(i);
+//checks the superblock of a version 3 image read from its first page
+int read_superblock(struct vsfs *fs, struct superblock *sbp) {
+    struct superblock sb = *sbp;
+    if (sb.crc != crc32(&sb, offsetof(struct superblock, crc)))
+        return -MARKER_ERR;
 
-    if (close(dev_id) < 0) return -CLOSE_ERR;
-    dev_id = -1;
+    fs->h = sb.h;
+    fs->journal = (sb.flags & SB_JOURNAL) != 0;
+    fs->clean = (sb.flags & SB_CLEAN) != 0;
+    fs->clean_blocks_free = sb.blocks_free;
+    fs->clean_files_free = sb.files_free;
+    if (!valid_block_size(fs->h.block_size) || fs->h.nblocks < 2 || fs->h.nfiles_max < 1)
+        return -MARKER_ERR;
+    layout_regions(fs);
 
+    struct superblock expected;
+    fill_superblock(fs, &expected);
+    if (sb.align != expected.align
+            || sb.bitmap_offset != expected.bitmap_offset
+            || sb.fstattab_offset != expected.fstattab_offset
+            || sb.dirtab_offset != expected.dirtab_offset
+            || sb.blocks_offset != expected.blocks_offset
+            || sb.journal_offset != expected.journal_offset)
+        return -MARKER_ERR;
     return 0;
 }
 
-int vs_getstat(int id, struct fstat *stat) {
-    int fstat_offset =
-                get_fstattab_offset() + id * sizeof(struct fstat);
+//writes the superblock with the clean flag and free counters of fs and syncs it
+int write_superblock(struct vsfs *fs) {
+    struct superblock sb;
+    fill_superblock(fs, &sb);
+    if (dev_write(fs, &sb, sizeof(sb), 0) < (int)sizeof(sb) || dev_sync(fs) < 0)
+        return -WRITE_ERR;
+    return 0;
+}
 
-    if (lseek(dev_id, fstat_offset, SEEK_SET) < 0)
-        return -READ_ERR;
+//superblock of the image fs is laid out as, jsize is the journal size when there is one
+void fill_superblock(struct vsfs *fs, struct superblock *sb) {
+    memset(sb, 0, sizeof(*sb));
+    memcpy(sb->marker, aligned_marker, sizeof(sb->marker));
+    sb->h = fs->h;
+    sb->flags = (fs->journal ? SB_JOURNAL : 0) | (fs->clean ? SB_CLEAN : 0);
+    sb->align = fs->h.block_size > FORMAT_ALIGN ? fs->h.block_size : FORMAT_ALIGN;
+    sb->bitmap_offset = fs->bitmap_offset;
+    sb->fstattab_offset = fs->fstattab_offset;
+    sb->dirtab_offset = fs->dirtab_offset;
+    sb->blocks_offset = fs->blocks_offset;
+    sb->journal_offset = fs->journal ? fs->jstart : 0;
+    sb->journal_size = fs->journal ? fs->jsize : 0;
+    sb->blocks_free = fs->bitmap_nfree;
+    sb->files_free = fs->ino_nfree;
+    sb->crc = crc32(sb, offsetof(struct superblock, crc));
+}
 
-    if (read(dev_id, stat, sizeof(struct fstat)) < 0)
-        return -READ_ERR;
+//places the regions after the header: packed one after another in version 1
+//and 2 images, each at a multiple of the alignment in version 3 images
+void layout_regions(struct vsfs *fs) {
+    off_t align = 1;
+    off_t bitmap_size = fs->h.nblocks * sizeof(char);
+    fs->bitmap_offset = sizeof(start_marker) + sizeof(struct header);
+    if (fs->aligned) {
+        align = fs->h.block_size > FORMAT_ALIGN ? fs->h.block_size : FORMAT_ALIGN;
+        bitmap_size = (off_t)(fs->h.nblocks + 63) / 64 * sizeof(uint64_t);
+        fs->bitmap_offset = align;
+    }
+    fs->fstattab_offset = ROUND_UP(fs->bitmap_offset + bitmap_size, align);
+    fs->dirtab_offset = ROUND_UP(fs->fstattab_offset + (off_t)fs->h.nfiles_max * sizeof(struct fstat), align);
+    fs->blocks_offset = ROUND_UP(fs->dirtab_offset + (off_t)(fs->h.nfiles_max + 1) * sizeof(struct dir_rec), align);
+    fs->jstart = ROUND_UP(fs->blocks_offset + (off_t)fs->h.nblocks * fs->h.block_size, align);
+}
+
+//no other call may be in progress or follow on fs
+int vs_umount(struct vsfs *fs) {
+    aio_shutdown(fs);
+    ns_lock_all(fs);
+    if (batch_commit(fs) < 0) {
+        ns_unlock_all(fs);
+        return -WRITE_ERR;
+    }
+
+    for (int i = 0; i < fs->ndescrs; i++) {
+        struct descr *d = descr_at(fs, i);
+        if (d->id >= 0) close_file(fs, descr_fd(d, i));
+    }
+
+    //journal is left empty, so the next mount has nothing to replay; a
+    //read-only mount leaves the image as it found it
+    int err = 0;
+    if (fs->rdonly) {
+        //nothing was changed
+    } else if (fs->journal) {
+        if (journal_commit(fs) < 0 || journal_checkpoint(fs) < 0)
+            err = -WRITE_ERR;
+    } else if (flush_inodes(fs) < 0 || buf_flush(fs) < 0 || flush_bitmap(fs) < 0) {
+        err = -WRITE_ERR;
+    }
+    if (err == 0 && fs->dev_map != NULL && msync(fs->dev_map, fs->dev_map_size, MS_SYNC) < 0)
+        err = -WRITE_ERR;
+
+    //image is marked clean only once everything else is durable
+    if (err == 0 && fs->aligned && !fs->rdonly) {
+        fs->clean = 1;
+        if (dev_sync(fs) < 0 || write_superblock(fs) < 0)
+            err = -WRITE_ERR;
+    }
+    ns_unlock_all(fs);
+    if (err < 0)
+        return err;
+
+    if (fs->dev_map != NULL)
+        munmap(fs->dev_map, fs->dev_map_size);
+
+    free(fs->bitmap);
+    free(fs->dirtab);
+    free(fs->dir_index);
+    free(fs->dir_free);
+    free(fs->ino_free);
+    buf_free(fs);
+    journal_free(fs);
+    descr_table_free(fs);
+    locks_destroy(fs);
+
+    err = close(fs->dev_id);
+    free(fs);
+    if (err < 0) return -CLOSE_ERR;
 
     return 0;
 }
 
-//if next == 0 then first record is read, 
-//else all the records are read sequentially
-int vs_readdir(struct dir_rec *dir_rec, int next) {
-    if (!next) {    
-        if (lseek(dev_id, get_dirtab_offset(), SEEK_SET) < 0)
-            return -READ_ERR;
-    }
+int vs_sync(struct vsfs *fs) {
+    ns_lock_all(fs);
+    int err = sync_image(fs);
+    ns_unlock_all(fs);
+    return err;
+}
+
+int sync_image(struct vsfs *fs) {
+    if (fs->journal)
+        return journal_commit(fs);
+
+    if (flush_inodes(fs) < 0 || flush_dirtab(fs) < 0 || buf_flush(fs) < 0 || flush_bitmap(fs) < 0)
+        return -WRITE_ERR;
+
+    if (fs->dev_map != NULL && msync(fs->dev_map, fs->dev_map_size, MS_SYNC) < 0)
+        return -WRITE_ERR;
 
-    if (read(dev_id, dir_rec, sizeof(struct dir_rec)) < 0)
-        return -READ_ERR;
-    
     return 0;
 }
 
-int vs_create(char *pathname) {
-    int dirtab_size = sizeof(struct dir_rec) * (h.nfiles_max + 1);
-    struct dir_rec *dirtab = malloc(dirtab_size);
-    if (read_dirtab(dirtab) < 0) {
-        free(dirtab);
-        return -READ_ERR;
+//writes the cache back and replaces it with one of nframes frames, counters are kept
+int vs_set_cache_size(struct vsfs *fs, int nframes) {
+    if (nframes < VS_CACHE_MIN_FRAMES)
+        return -SIZE_ERR;
+
+    int err = 0;
+    ns_lock_all(fs);
+    if (buf_flush(fs) < 0) {
+        err = -WRITE_ERR;
+    } else {
+        buf_free(fs);
+        if (buf_init(fs, nframes) < 0)
+            err = -SIZE_ERR;
     }
+    ns_unlock_all(fs);
+    return err;
+}
 
-    int i;
-    for (i = 0; i < h.nfiles_max && dirtab[i].id >= 0; i++) {
-        if (0 == strcmp(dirtab[i].name, pathname)) {
-            free(dirtab);
-            return -EXIST_ERR;
+/*
+  Namespace changes (create, link, unlink) made after vs_batch_begin are
+  kept in memory and written by vs_batch_commit: all changed directory
+  records with one write and changed inodes with one write per run of
+  consecutive ids. Nothing of the batch is on the image before the commit
+  (or vs_sync) returns.
+*/
+int vs_batch_begin(struct vsfs *fs) {
+    ns_lock_all(fs);
+    fs->batch = 1;
+    ns_unlock_all(fs);
+    return 0;
+}
+
+int vs_batch_commit(struct vsfs *fs) {
+    ns_lock_all(fs);
+    int err = batch_commit(fs);
+    ns_unlock_all(fs);
+    return err;
+}
+
+int batch_commit(struct vsfs *fs) {
+    if (!fs->batch)
+        return 0;
+    fs->batch = 0;
+
+    int err = 0;
+    if (flush_inodes(fs) < 0 || flush_dirtab(fs) < 0)
+        err = -WRITE_ERR;
+
+    //dropping inodes below may write them too, so the journal is committed after it
+
+    //inodes kept for the batch are dropped unless a descriptor refers to them
+    for (int i = 0; i < MAX_FILES_OPENED; i++) {
+        struct inode *ino = fs->inode_buckets[i];
+        while (ino != NULL) {
+            struct inode *next = ino->next;
+            if (ino->nopen == 0 && inode_put(fs, ino) < 0)
+                err = -WRITE_ERR;
+            ino = next;
         }
     }
-    free(dirtab);
-    if (i >= h.nfiles_max) return -MAXFILES_ERR;
-    
-    int fstattab_size = sizeof(struct fstat) * h.nfiles_max;
-    struct fstat *fstattab = malloc(fstattab_size);
-    if (read_fstattab(fstattab) < 0) {
-        free(fstattab);
+    if (fs->journal && journal_commit(fs) < 0)
+        err = -WRITE_ERR;
+    return err;
+}
+
+//free space summary, counters are kept up to date so no table is scanned
+int vs_statfs(struct vsfs *fs, struct vs_statfs *st) {
+    ns_lock_shared(fs, 0);
+    pthread_mutex_lock(&fs->icache_lock);
+    pthread_mutex_lock(&fs->alloc_lock);
+    st->block_size = fs->h.block_size;
+    st->blocks = fs->h.nblocks;
+    st->blocks_free = fs->bitmap_nfree + fs->jnfree - fs->da_reserved;
+    st->files = fs->h.nfiles_max;
+    st->files_free = fs->ino_nfree;
+    st->names_free = fs->dir_nfree;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    pthread_mutex_unlock(&fs->icache_lock);
+    ns_unlock_shared(fs, 0);
+    return 0;
+}
+
+int vs_get_cache_stats(struct vsfs *fs, struct vs_cache_stats *stats) {
+    pthread_mutex_lock(&fs->buf_lock);
+    *stats = fs->cache_stats;
+    stats->nframes = fs->nbufs;
+    pthread_mutex_unlock(&fs->buf_lock);
+    return 0;
+}
+
+//counters are read one by one while other threads may be adding to them
+int vs_get_stats(struct vsfs *fs, struct vs_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef VSFS_STATS
+    stats->enabled = 1;
+    long *src = (long *)fs->stats;
+    long *dst = (long *)stats->ops;
+    for (int i = 0; i < (int)(VS_NOPS * sizeof(struct vs_op_stats) / sizeof(long)); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+#else
+    (void)fs;
+#endif
+    return 0;
+}
+
+int vs_reset_stats(struct vsfs *fs) {
+#ifdef VSFS_STATS
+    long *c = (long *)fs->stats;
+    for (int i = 0; i < (int)(VS_NOPS * sizeof(struct vs_op_stats) / sizeof(long)); i++)
+        __atomic_store_n(&c[i], 0, __ATOMIC_RELAXED);
+#else
+    (void)fs;
+#endif
+    return 0;
+}
+
+int vs_getstat(struct vsfs *fs, int id, struct fstat *stat) {
+    ns_lock_shared(fs, id);
+    pthread_mutex_lock(&fs->icache_lock);
+    int err = 0;
+    struct inode *ino = inode_find(fs, id);
+    if (ino != NULL) {
+        pthread_rwlock_rdlock(&ino->lock);
+        *stat = ino->stat;
+        pthread_rwlock_unlock(&ino->lock);
+    } else {
+        err = read_stat(fs, id, stat);
+    }
+    pthread_mutex_unlock(&fs->icache_lock);
+    ns_unlock_shared(fs, id);
+    return err;
+}
+
+//fstat of inode id as it is on the image (and in the open journal transaction)
+int read_stat(struct vsfs *fs, int id, struct fstat *stat) {
+    off_t fstat_offset =
+                get_fstattab_offset(fs) + (off_t)id * sizeof(struct fstat);
+
+    if (meta_read(fs, stat, sizeof(struct fstat), fstat_offset) < 0)
         return -READ_ERR;
+
+    //tables of lazily formatted images are zero, unused entries are reported as formatted
+    if (stat->nlinks == 0) {
+        stat->ftype = -1;
+        stat->size = 0;
+        for (int j = 0; j < FILE_BLOCKS; j++)
+            stat->blocks_map[j] = -1;
     }
-    
-    int id;
-    for (id = 0; id < h.nfiles_max && fstattab[id].nlinks > 0; id++)
-        ;
-    free(fstattab);
-    if (id >= h.nfiles_max) return -MAXFILES_ERR;
+
+    return 0;
+}
+
+//reads the record under *cursor and advances it, *cursor = 0 starts from the
+//first record. Last record of the table has id END_ID
+int vs_readdir(struct vsfs *fs, struct dir_rec *dir_rec, int *cursor) {
+    STATS_BEGIN(probe);
+    if (*cursor < 0 || *cursor > fs->h.nfiles_max) {
+        STATS_END(fs, probe, VS_OP_READDIR, 0, 1);
+        return -EOF_ERR;
+    }
+
+    ns_lock_shared(fs, *cursor);
+    *dir_rec = fs->dirtab[*cursor];
+    ns_unlock_shared(fs, *cursor);
+    (*cursor)++;
+    STATS_END(fs, probe, VS_OP_READDIR, 0, 0);
+    return 0;
+}
+
+int vs_create(struct vsfs *fs, char *pathname) {
+    STATS_BEGIN(probe);
+    ns_lock_all(fs);
+    int err = create_file(fs, pathname);
+    ns_unlock_all(fs);
+    STATS_END(fs, probe, VS_OP_CREATE, 0, err < 0);
+    return err;
+}
+
+int create_file(struct vsfs *fs, char *pathname) {
+    //record without a name is taken as unused at mount (see load_dirtab)
+    if (pathname[0] <= 0)
+        return -CREATE_ERR;
+
+    if (journal_check(fs) < 0)
+        return -WRITE_ERR;
+
+    if (dir_lookup(fs, pathname) >= 0)
+        return -EXIST_ERR;
+
+    if (fs->dir_nfree == 0 || fs->ino_nfree == 0) return -MAXFILES_ERR;
+
+    int id = fs->ino_free[fs->ino_nfree - 1];
     
     struct fstat stat = {
         .ftype = 0,
@@ -228,252 +1311,718 @@ int vs_create(char *pathname) {
     for (; j < MAX_NAMESIZE; j++)
         dirrec.name[j] = 0;
 
-    if (write_fstat(&stat, id) < 0)
+    //inode created during a batch is written at commit
+    if (fs->batch) {
+        struct inode *ino = inode_alloc(id, &stat);
+        ino->dirty = 1;
+        inode_insert(fs, ino);
+    } else if (write_fstat(fs, &stat, id) < 0) {
         return -WRITE_ERR;
+    }
+    fs->ino_nfree--;
 
-    if (write_dir_rec(&dirrec, i) < 0)
+    int i = dir_alloc_slot(fs);
+    if (write_dir_rec(fs, &dirrec, i) < 0) {
+        dir_release_slot(fs, i);
         return -WRITE_ERR;
+    }
+    fs->dirtab[i] = dirrec;
+    dir_index_insert(fs, i);
     
     return 0;
 }
 
-int vs_open(char *pathname) {
-    int dirtab_size = sizeof(struct dir_rec) * (h.nfiles_max + 1);
-    struct dir_rec *dirtab_buf = malloc(dirtab_size);
+//name lookups lock the stripe of the name hash, descriptor calls the stripe of the descriptor
+int vs_open(struct vsfs *fs, char *pathname) {
+    STATS_BEGIN(probe);
+    unsigned int key = dir_hash(pathname);
+    ns_lock_shared(fs, key);
+    int err = open_file(fs, pathname);
+    ns_unlock_shared(fs, key);
+    STATS_END(fs, probe, VS_OP_OPEN, 0, err < 0);
+    return err;
+}
+
+//inode id of the file named pathname, the number vs_getstat takes
+int vs_lookup(struct vsfs *fs, char *pathname) {
+    unsigned int key = dir_hash(pathname);
+    ns_lock_shared(fs, key);
+    int i = dir_lookup(fs, pathname);
+    int id = i < 0 ? -NOTEXIST_ERR : fs->dirtab[i].id;
+    ns_unlock_shared(fs, key);
+    return id;
+}
+
+//descriptor is published only once its inode is cached and counted as open
+int open_file(struct vsfs *fs, char *pathname) {
+    int i = dir_lookup(fs, pathname);
+    if (i < 0)
+        return -NOTEXIST_ERR;
+    int id = fs->dirtab[i].id;
 
-    if (read_dirtab(dirtab_buf) < 0) {
-        free(dirtab_buf);
+    pthread_mutex_lock(&fs->icache_lock);
+    struct inode *ino = inode_get(fs, id);
+    if (ino != NULL)
+        ino->nopen++;
+    pthread_mutex_unlock(&fs->icache_lock);
+    if (ino == NULL)
         return -READ_ERR;
-    }
 
-    for (int i = 0; i < h.nfiles_max; i++) {
-        if (0 == strcmp(dirtab_buf[i].name, pathname)) {
-            int desc = next_descriptor();
-            if (desc < 0) {
-                free(dirtab_buf);
-                return -MAX_FOPENED_ERR;
-            }
-            descrs_tab[desc] = dirtab_buf[i].id;
-            free(dirtab_buf);
-            return desc;
-        }
+    int index = descr_pop(fs);
+    if (index < 0) {
+        pthread_mutex_lock(&fs->icache_lock);
+        pthread_mutex_lock(&fs->alloc_lock);
+        ino->nopen--;
+        inode_put(fs, ino);
+        pthread_mutex_unlock(&fs->alloc_lock);
+        pthread_mutex_unlock(&fs->icache_lock);
+        return -MAX_FOPENED_ERR;
     }
-    free(dirtab_buf);
-    return -NOTEXIST_ERR;
-}
 
-int vs_close(int fd) {
-    if (fd < 0 || fd >= MAX_FILES_OPENED || descrs_tab[fd] == -1)
-        return -BADDESC_ERR;
+    struct descr *d = descr_at(fs, index);
+    d->ino = ino;
+    __atomic_store_n(&d->pos, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->ra_next, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->ra_window, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->ra_end, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->id, id, __ATOMIC_RELEASE);
+    return descr_fd(d, index);
+}
+
+//the stripe of fd is taken exclusively, so that reads and writes of fd that
+//got its entry with descr_get are done with the inode before it is dropped
+int vs_close(struct vsfs *fs, int fd) {
+    if (journal_pending(fs)) {
+        ns_lock_all(fs);
+        int err = journal_check(fs);
+        ns_unlock_all(fs);
+        if (err < 0)
+            return -WRITE_ERR;
+    }
+
+    ns_lock_exclusive(fs, fd);
+    int err = close_file(fs, fd);
+    ns_unlock_exclusive(fs, fd);
+    return err;
+}
+
+int close_file(struct vsfs *fs, int fd) {
+    struct descr *d = descr_get(fs, fd);
+    if (d == NULL)
+        return -BADDESC_ERR;
+
+    //of concurrent closes of fd only the one bumping the generation goes on
+    uint32_t gen = __atomic_load_n(&d->gen, __ATOMIC_ACQUIRE);
+    if ((gen & DESCR_GEN_MASK) != (uint32_t)fd >> DESCR_INDEX_BITS
+            || !__atomic_compare_exchange_n(&d->gen, &gen, gen + 1, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return -BADDESC_ERR;
+    struct inode *ino = d->ino;
+    d->ino = NULL;
+    __atomic_store_n(&d->id, -1, __ATOMIC_RELEASE);
+    descr_push(fs, fd & DESCR_INDEX_MASK, d);
+
+    //buffered appends get their blocks before alloc_lock is taken below
+    pthread_rwlock_wrlock(&ino->lock);
+    int err = da_flush(fs, ino);
+    pthread_rwlock_unlock(&ino->lock);
+
+    //writing back the last reference may allocate or free extent blocks
+    pthread_mutex_lock(&fs->icache_lock);
+    pthread_mutex_lock(&fs->alloc_lock);
+    ino->nopen--;
+    if (inode_put(fs, ino) < 0)
+        err = -WRITE_ERR;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    pthread_mutex_unlock(&fs->icache_lock);
+    if (err < 0)
+        return -WRITE_ERR;
 
-    descrs_tab[fd] = -1;
     return 0;
 }
 
-int vs_read(int fd, int offset, int size, char *buffer) {
-    if (fd < 0 || fd >= MAX_FILES_OPENED || descrs_tab[fd] == -1)
+int vs_read(struct vsfs *fs, int fd, int offset, int size, char *buffer) {
+    STATS_BEGIN(probe);
+    int n = descr_read(fs, fd, offset, size, buffer, 0);
+    STATS_END(fs, probe, VS_OP_READ, n > 0 ? n : 0, n < 0);
+    return n;
+}
+
+//reads from the position of the descriptor and moves it past the data read
+int vs_seq_read(struct vsfs *fs, int fd, int size, char *buffer) {
+    STATS_BEGIN(probe);
+    int n = descr_read(fs, fd, 0, size, buffer, 1);
+    STATS_END(fs, probe, VS_OP_READ, n > 0 ? n : 0, n < 0);
+    return n;
+}
+
+int vs_seq_write(struct vsfs *fs, int fd, int size, char *buffer) {
+    STATS_BEGIN(probe);
+    int n = descr_write(fs, fd, 0, size, buffer, 1);
+    STATS_END(fs, probe, VS_OP_WRITE, n > 0 ? n : 0, n < 0);
+    return n;
+}
+
+//sets the position of the descriptor relative to VS_SEEK_* whence and returns it
+int vs_seek(struct vsfs *fs, int fd, int offset, int whence) {
+    ns_lock_shared(fs, fd);
+    struct descr *d = descr_get(fs, fd);
+    if (d == NULL) {
+        ns_unlock_shared(fs, fd);
         return -BADDESC_ERR;
+    }
 
-    int id = descrs_tab[fd];
-    struct fstat *stat = malloc(sizeof(struct fstat));
-    if (vs_getstat(id, stat) < 0) {
-        free(stat);
-        return -READ_ERR;
+    long long pos = offset;
+    if (whence == VS_SEEK_CUR) {
+        pos += __atomic_load_n(&d->pos, __ATOMIC_RELAXED);
+    } else if (whence == VS_SEEK_END) {
+        pthread_rwlock_rdlock(&d->ino->lock);
+        pos += d->ino->stat.size;
+        pthread_rwlock_unlock(&d->ino->lock);
+    } else if (whence != VS_SEEK_SET) {
+        pos = -1;
     }
-    
-    if (offset >= stat->size) {
-        free(stat);
-        return 0;
+
+    int err = -SIZE_ERR;
+    if (pos >= 0 && pos <= INT_MAX) {
+        __atomic_store_n(&d->pos, (int)pos, __ATOMIC_RELAXED);
+        err = (int)pos;
+    }
+    ns_unlock_shared(fs, fd);
+    return err;
+}
+
+//with seq set offset is the position of the descriptor, which is advanced
+int descr_read(struct vsfs *fs, int fd, int offset, int size, char *buffer, int seq) {
+    ns_lock_shared(fs, fd);
+    int err = -BADDESC_ERR;
+    struct descr *d = descr_get(fs, fd);
+    if (d != NULL) {
+        pthread_rwlock_rdlock(&d->ino->lock);
+        if (seq)
+            offset = __atomic_load_n(&d->pos, __ATOMIC_RELAXED);
+        err = read_file(fs, d->ino, offset, size, buffer);
+        if (err > 0)
+            da_read(fs, d->ino, offset, err, buffer);
+        if (seq && err > 0)
+            __atomic_store_n(&d->pos, offset + err, __ATOMIC_RELAXED);
+        if (err > 0)
+            readahead(fs, d, offset, err);
+        pthread_rwlock_unlock(&d->ino->lock);
+    }
+    ns_unlock_shared(fs, fd);
+    return err;
+}
+
+/*
+  Readahead of sequential reads. A read starting where the previous read of
+  the descriptor ended is sequential, any other read resets the window.
+  Once a sequential reader gets into the second half of the blocks read
+  ahead (or reads at all for the first time), the window doubles and the
+  blocks up to the new window end are read into the buffer cache, one call
+  per physically contiguous run. The window after that is only announced
+  to the kernel, which has it read from the device by the time it is
+  needed. Called with the inode lock held.
+*/
+void readahead(struct vsfs *fs, struct descr *d, int offset, int len) {
+    int bs = fs->h.block_size;
+    int next = __atomic_exchange_n(&d->ra_next, offset + len, __ATOMIC_RELAXED);
+    if (offset != next) {
+        __atomic_store_n(&d->ra_window, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&d->ra_end, 0, __ATOMIC_RELAXED);
+        return;
     }
 
-    int block_offset = offset / h.block_size;
-    int byte_offset = offset - block_offset * h.block_size;
+    int end = (offset + len + bs - 1) / bs;
+    int window = __atomic_load_n(&d->ra_window, __ATOMIC_RELAXED);
+    int ra_end = __atomic_load_n(&d->ra_end, __ATOMIC_RELAXED);
+    if (end + window / 2 < ra_end)
+        return;
 
-    int full_size = size;
+    int max = READAHEAD_MAX / bs < fs->nbufs / 4 ? READAHEAD_MAX / bs : fs->nbufs / 4;
+    window = window == 0 ? READAHEAD_MIN / bs : 2 * window;
+    if (window > max)
+        window = max;
+    if (window < 1)
+        window = 1;
 
-    while (size > 0) {
-        int blockid = get_block_id(stat, block_offset, 0);
+    int nblocks = (d->ino->stat.size + bs - 1) / bs;
+    int start = ra_end > end ? ra_end : end;
+    int stop = end + window < nblocks ? end + window : nblocks;
+    if (start < stop)
+        prefetch(fs, d->ino, start, stop - start, 0);
+    if (stop < nblocks)
+        prefetch(fs, d->ino, stop, stop + window < nblocks ? window : nblocks - stop, 1);
 
-        if (blockid < 0) {
-            free(stat);
-            return full_size - size;
+    __atomic_store_n(&d->ra_window, window, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->ra_end, stop, __ATOMIC_RELAXED);
+}
+
+//reads nblocks blocks of the file from lblock into the buffer cache, with
+//hint set only tells the kernel about them, in as few ranges as gaps between
+//runs allow. Holes are skipped
+void prefetch(struct vsfs *fs, struct inode *ino, int lblock, int nblocks, int hint) {
+    int bs = fs->h.block_size;
+    int window = nblocks;
+    int lo = -1, hi = -1;
+    while (nblocks > 0) {
+        int run;
+        int blockid = bmap_lookup(fs, ino, lblock, nblocks, &run);
+        if (blockid >= 0 && hint) {
+            if (lo >= 0 && (blockid < lo || blockid > hi + window)) {
+                dev_advise(fs, get_blocks_offset(fs) + (off_t)lo * bs, (off_t)(hi - lo) * bs);
+                lo = -1;
+            }
+            if (lo < 0)
+                lo = blockid;
+            if (blockid + run > hi)
+                hi = blockid + run;
+        } else if (blockid >= 0 && buf_read(fs, blockid, run, 0, run * bs, NULL) < 0) {
+            return;
         }
-        int read_offset = get_blocks_offset()
-                          + blockid * h.block_size
-                          + byte_offset;
+        lblock += run;
+        nblocks -= run;
+    }
+    if (lo >= 0)
+        dev_advise(fs, get_blocks_offset(fs) + (off_t)lo * bs, (off_t)(hi - lo) * bs);
+}
+
+int read_file(struct vsfs *fs, struct inode *ino, int offset, int size, char *buffer) {
+    struct fstat *stat = &ino->stat;
+    
+    if (offset >= stat->size)
+        return 0;
+
+    if (size > stat->size - offset)
+        size = stat->size - offset;
+
+    int block_offset = offset / fs->h.block_size;
+    int byte_offset = offset - block_offset * fs->h.block_size;
 
-        if (lseek(dev_id, read_offset, SEEK_SET) < 0) {
-            free(stat);
+    int done = 0;
+
+    while (done < size) {
+        //physically contiguous blocks are read with a single call
+        int nleft = (byte_offset + size - done + fs->h.block_size - 1) / fs->h.block_size;
+        int run;
+        int blockid = bmap_lookup(fs, ino, block_offset, nleft, &run);
+
+        int len = run * fs->h.block_size - byte_offset;
+        if (len > size - done)
+            len = size - done;
+
+        //holes read as zeros
+        int rsize;
+        if (blockid < 0) {
+            memset(buffer + done, 0, len);
+            rsize = len;
+        } else if ((rsize = buf_read(fs, blockid, run, byte_offset, len, buffer + done)) < 0) {
             return -READ_ERR;
         }
-        
-        int rem = h.block_size - byte_offset;
-        if (rem >= size) {
-            int rsize;
-            if ((rsize = read(dev_id, buffer, size)) < 0){
-                free(stat);
-                return -READ_ERR;
-            }
-            size -= rsize;
-            free(stat);
-            return full_size - size;
-        } else {
-            int rsize;
-            if ((rsize = read(dev_id, buffer, rem)) < 0) {
-                free(stat);
-                return -READ_ERR;
+
+        done += rsize;
+        if (rsize < len)
+            return done;
+
+        byte_offset = 0;
+        block_offset += run;
+    }
+    return done;
+}
+
+int vs_write(struct vsfs *fs, int fd, int offset, int size, char *buffer) {
+    STATS_BEGIN(probe);
+    int n = descr_write(fs, fd, offset, size, buffer, 0);
+    STATS_END(fs, probe, VS_OP_WRITE, n > 0 ? n : 0, n < 0);
+    return n;
+}
+
+int descr_write(struct vsfs *fs, int fd, int offset, int size, char *buffer, int seq) {
+    ns_lock_shared(fs, fd);
+    int err = -BADDESC_ERR;
+    struct descr *d = NULL;
+    if (journal_check_shared(fs, fd) < 0)
+        err = -WRITE_ERR;
+    else
+        d = descr_get(fs, fd);
+    if (d != NULL) {
+        pthread_rwlock_wrlock(&d->ino->lock);
+        if (seq)
+            offset = __atomic_load_n(&d->pos, __ATOMIC_RELAXED);
+        err = write_file(fs, d->ino, offset, size, buffer);
+        if (seq && err > 0)
+            __atomic_store_n(&d->pos, offset + err, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&d->ino->lock);
+    }
+    ns_unlock_shared(fs, fd);
+    return err;
+}
+
+/*
+  Delayed allocation. Small appends are collected in a buffer of the inode
+  and blocks are allocated for them only when the buffer fills up, the file
+  is closed or extended by vs_truncate, or inodes are written back (vs_sync,
+  journal commits, batches). A file growing by a few hundred bytes at a time
+  thus gets a run of contiguous blocks filled with one buffer cache write
+  instead of a block allocated and partially written at every append. The
+  buffer starts at the first block of the append that is not mapped yet,
+  the part of the append landing in the mapped last block is written there
+  at once. Blocks are reserved as the buffer grows, so buffered data never
+  lacks space on flush. Reads see buffered data over the holes where it
+  goes, other writes reaching it flush it first.
+*/
+int write_file(struct vsfs *fs, struct inode *ino, int offset, int size, char *buffer) {
+    if (offset == ino->stat.size && size > 0)
+        return da_write(fs, ino, offset, size, buffer);
+
+    if (ino->da_len > 0 && (long long)offset + size > (long long)ino->da_block * fs->h.block_size
+            && da_flush(fs, ino) < 0)
+        return -WRITE_ERR;
+    return write_blocks(fs, ino, offset, size, buffer);
+}
+
+int da_write(struct vsfs *fs, struct inode *ino, int offset, int size, char *buffer) {
+    int bs = fs->h.block_size;
+    int cap = DELALLOC_SIZE > bs ? DELALLOC_SIZE : bs;
+
+    int done = 0;
+    while (done < size) {
+        int pos = offset + done;
+        if (ino->da_len == 0) {
+            //appends as big as the buffer gain nothing from it
+            if (size - done >= cap)
+                break;
+
+            //the rest of a mapped block is written in place
+            int run;
+            if (bmap_lookup(fs, ino, pos / bs, 1, &run) >= 0) {
+                int len = bs - pos % bs;
+                if (len > size - done)
+                    len = size - done;
+                int wsize = write_blocks(fs, ino, pos, len, buffer + done);
+                if (wsize < 0)
+                    return done > 0 ? done : wsize;
+                done += wsize;
+                if (wsize < len)
+                    return done;
+                continue;
             }
-            if (rsize == 0) {
-                free(stat);
-                return full_size - size;
+
+            //the buffer starts at a block boundary, the part of the block
+            //before pos is a hole of the file and reads as zeros
+            if (ino->da_buf == NULL) {
+                pthread_mutex_lock(&fs->alloc_lock);
+                int full = fs->da_bytes + cap > DELALLOC_MAX;
+                if (!full)
+                    fs->da_bytes += cap;
+                pthread_mutex_unlock(&fs->alloc_lock);
+                if (full)
+                    break;
+                ino->da_buf = malloc(cap);
             }
-            buffer += rsize;
-            size -= rsize;
-            byte_offset = 0;
-            block_offset++;
+            ino->da_block = pos / bs;
+            ino->da_len = pos % bs;
+            memset(ino->da_buf, 0, ino->da_len);
+        }
+
+        int len = cap - ino->da_len;
+        if (len > size - done)
+            len = size - done;
+        if (da_reserve(fs, ino, len) < 0) {
+            if (da_flush(fs, ino) < 0)
+                return done > 0 ? done : -WRITE_ERR;
+            break;
         }
+        memcpy(ino->da_buf + ino->da_len, buffer + done, len);
+        ino->da_len += len;
+        done += len;
+        ino->stat.size = offset + done;
+        ino->dirty = 1;
+
+        if (ino->da_len == cap && da_flush(fs, ino) < 0)
+            return -WRITE_ERR;
     }
-    free(stat);
-    return full_size;
+
+    //the rest goes to blocks allocated right away
+    if (done < size) {
+        int wsize = write_blocks(fs, ino, offset + done, size - done, buffer + done);
+        if (wsize < 0)
+            return done > 0 ? done : wsize;
+        done += wsize;
+    }
+    return done;
 }
 
-int vs_write(int fd, int offset, int size, char *buffer) {
-    if (fd < 0 || fd >= MAX_FILES_OPENED || descrs_tab[fd] == -1)
-        return -BADDESC_ERR;
+//reserves blocks for len more bytes of the buffer, fails when the image
+//doesn't have them or a version 1 file can't map them
+int da_reserve(struct vsfs *fs, struct inode *ino, int len) {
+    int bs = fs->h.block_size;
+    int need = (ino->da_len + len + bs - 1) / bs;
+    if (fs->version == FORMAT_BLOCKMAP
+            && ino->da_block + need > FILE_BLOCKS - 1 + bs / (int)sizeof(int))
+        return -1;
+    if (need <= ino->da_nres)
+        return 0;
+
+    int err = 0;
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (fs->bitmap_nfree - fs->da_reserved < need - ino->da_nres) {
+        err = -1;
+    } else {
+        fs->da_reserved += need - ino->da_nres;
+        ino->da_nres = need;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return err;
+}
 
-    int id = descrs_tab[fd];
-    struct fstat *stat = malloc(sizeof(struct fstat));
+//allocates blocks for buffered appends and writes them, releases the buffer.
+//Called with the inode lock held exclusively (or running alone) and alloc_lock not held
+int da_flush(struct vsfs *fs, struct inode *ino) {
+    if (ino->da_buf == NULL)
+        return 0;
 
-    int fstat_offset = get_fstattab_offset()
-                       + id * sizeof(struct fstat);
+    int bs = fs->h.block_size;
+    int len = ino->da_len;
+    int err = 0;
+    ino->da_len = 0;
+    if (len > 0 && write_blocks(fs, ino, ino->da_block * bs, len, ino->da_buf) != len)
+        err = -WRITE_ERR;
 
-    if (vs_getstat(id, stat) < 0) {
-        free(stat);
-        return -READ_ERR;
-    }
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->da_reserved -= ino->da_nres;
+    fs->da_bytes -= DELALLOC_SIZE > bs ? DELALLOC_SIZE : bs;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    ino->da_nres = 0;
+    free(ino->da_buf);
+    ino->da_buf = NULL;
+    return err;
+}
 
-    int writesize = size;
-    int null_size = 0;
-    if (offset > stat->size) {
-        null_size = offset - stat->size;
-        writesize += null_size;
-        offset = stat->size;
-    }
-    char *writebuf = malloc(writesize * sizeof(char));
-    int i;
-    for (i = 0; i < null_size; i++)
-        writebuf[i] = '\0';
-    for (; i < writesize; i++)
-        writebuf[i] = buffer[i];
+//drops buffered appends past size, their reservation is kept till the flush
+void da_trim(struct vsfs *fs, struct inode *ino, int size) {
+    long long start = (long long)ino->da_block * fs->h.block_size;
+    if (ino->da_len == 0 || size >= start + ino->da_len)
+        return;
+    ino->da_len = size > start ? size - start : 0;
+}
+
+//copies buffered appends over the zeros read from the holes where they go
+void da_read(struct vsfs *fs, struct inode *ino, int offset, int len, char *buffer) {
+    if (ino->da_len == 0)
+        return;
+    long long start = (long long)ino->da_block * fs->h.block_size;
+    long long lo = offset > start ? offset : start;
+    long long hi = offset + len < start + ino->da_len ? offset + len : start + ino->da_len;
+    if (lo < hi)
+        memcpy(buffer + (lo - offset), ino->da_buf + (lo - start), hi - lo);
+}
 
-    int block_offset = offset / h.block_size;
-    int byte_offset = offset - block_offset * h.block_size;
+int write_blocks(struct vsfs *fs, struct inode *ino, int offset, int size, char *buffer) {
+    struct fstat *stat = &ino->stat;
 
-    int full_size = writesize;
+    int block_offset = offset / fs->h.block_size;
+    int byte_offset = offset - block_offset * fs->h.block_size;
 
-    while (writesize > 0) {
-        int blockid = get_block_id(stat, block_offset, 1);
+    int done = 0;
 
+    while (done < size) {
+        //missing blocks are allocated as contiguous as the allocator can
+        //and every physically contiguous run is written with a single call.
+        //Only blocks written to are allocated, a gap past the end of file stays a hole
+        int nleft = (byte_offset + size - done + fs->h.block_size - 1) / fs->h.block_size;
+        int run;
+        int blockid = bmap_lookup(fs, ino, block_offset, nleft, &run);
+        int fresh = blockid < 0;
+        if (fresh) {
+            //blocks reserved for appends buffered by other files are left to them
+            pthread_mutex_lock(&fs->alloc_lock);
+            int avail = fs->bitmap_nfree - (fs->da_reserved - ino->da_nres);
+            if (avail <= 0)
+                blockid = -EOF_ERR;
+            else
+                blockid = bmap_alloc(fs, ino, block_offset, run < avail ? run : avail, &run);
+            pthread_mutex_unlock(&fs->alloc_lock);
+            ino->dirty = 1;
+        }
 
         if (blockid < 0) {
             if (blockid == -EOF_ERR 
-                || blockid == -1) return full_size - writesize;
+                || blockid == -1) return done;
             else return blockid;
         }
-        
-        int write_offset = get_blocks_offset()
-                           + blockid * h.block_size
-                           + byte_offset;
 
-        if (lseek(dev_id, write_offset, SEEK_SET) < 0) {
-            free(stat);
-            free(writebuf);
+        int len = run * fs->h.block_size - byte_offset;
+        if (len > size - done)
+            len = size - done;
+
+        int wsize;
+        if ((wsize = buf_write(fs, blockid, run, byte_offset, len, buffer + done, fresh)) < 0)
             return -WRITE_ERR;
-        }
 
-        int rem = h.block_size - byte_offset;
-        if (rem >= writesize) {
-            int wsize;
-            if ((wsize = write(dev_id, writebuf, writesize)) < 0){
-                free(stat);
-                free(writebuf);
-                return -WRITE_ERR;
-            }
-            if (stat->size < offset + wsize) {
-                stat->size = offset + wsize;
-                if (write_fstat(stat, id)) {
-                    free(stat);
-                    free(writebuf);
-                    return -WRITE_ERR;
-                }
-            }
-            writesize -= wsize;
-            free(stat);
-            free(writebuf);
-            return full_size - writesize;
-        } else {
-            int wsize;
-            if ((wsize = write(dev_id, writebuf, rem)) < 0) {
-                free(stat);
-                free(writebuf);
-                return -WRITE_ERR;
-            }
-            if (wsize == 0) {
-                free(stat);
-                free(writebuf);
-                return full_size - writesize;
-            }
-            writebuf += wsize;
-            writesize -= wsize;
-            byte_offset = 0;
-            block_offset++;
-            offset += h.block_size;
-            if (stat->size < offset + wsize) {
-                stat->size = offset + wsize;
-                if (write_fstat(stat, id)) {
-                    free(stat);
-                    free(writebuf);
-                    return -WRITE_ERR;
-                }
-            }
+        done += wsize;
+        if (stat->size < offset + done) {
+            stat->size = offset + done;
+            ino->dirty = 1;
         }
+
+        if (wsize < len)
+            return done;
+
+        byte_offset = 0;
+        block_offset += run;
     }
-    free(stat);
-    return full_size;
+    return done;
 }
 
-int vs_link(char *src_pathname, char *dest_pathname) {
-    int dirtab_size = sizeof(struct dir_rec) * (h.nfiles_max + 1);
-    struct dir_rec *dirtab_buf = malloc(dirtab_size);
-    if (read_dirtab(dirtab_buf) < 0) {
-        free(dirtab_buf);
-        return -READ_ERR;
-    }
+/*
+  Asynchronous reads and writes: vs_aio_submit returns once the requests are
+  started, vs_aio_poll and vs_aio_wait collect the finished ones and run
+  their callbacks. The descriptor from vs_aio_event_fd becomes readable when
+  requests finish; after it does, call vs_aio_poll until it returns fewer
+  requests than asked for.
+*/
 
-    struct fstat *stat = malloc(sizeof(struct fstat));
-    int id = -1;
-    int i = -1;
-    for (int j = 0; j < h.nfiles_max; j++) {
-        if (i == -1 && dirtab_buf[j].id == -1) i = j;
+//picks how requests are run: VS_AIO_URING falls back to VS_AIO_THREADS when
+//io_uring is not available. Only the first call, or first vs_aio_submit,
+//decides. Returns the mode in use
+int vs_aio_setup(struct vsfs *fs, int mode) {
+    pthread_mutex_lock(&fs->aio_lock);
+    int err = fs->aio_mode;
+    if (err == 0)
+        err = aio_setup(fs, mode);
+    pthread_mutex_unlock(&fs->aio_lock);
+    return err;
+}
 
-        if (0 == strcmp(dirtab_buf[j].name, src_pathname)) {
-            if (vs_getstat(dirtab_buf[j].id, stat) < 0) {
-                free(dirtab_buf);
-                free(stat);
-                return -READ_ERR;
-            }
-            id = dirtab_buf[j].id;
+//requests that can't be started finish with an error, returns nreqs
+int vs_aio_submit(struct vsfs *fs, struct vs_aio **reqs, int nreqs) {
+    if (__atomic_load_n(&fs->aio_mode, __ATOMIC_ACQUIRE) == 0) {
+        int err = vs_aio_setup(fs, VS_AIO_URING);
+        if (err < 0)
+            return err;
+    }
+
+    pthread_mutex_lock(&fs->aio_lock);
+    fs->aio_outstanding += nreqs;
+    if (fs->aio_mode == VS_AIO_THREADS) {
+        for (int i = 0; i < nreqs; i++) {
+            reqs[i]->next = NULL;
+            if (fs->aio_queue_tail != NULL)
+                fs->aio_queue_tail->next = reqs[i];
+            else
+                fs->aio_queue = reqs[i];
+            fs->aio_queue_tail = reqs[i];
         }
-        if (0 == strcmp(dirtab_buf[j].name, dest_pathname)){
-            free(dirtab_buf);
-            free(stat);
-            return -EXIST_ERR;
+        pthread_cond_broadcast(&fs->aio_queue_cond);
+        pthread_mutex_unlock(&fs->aio_lock);
+        return nreqs;
+    }
+    pthread_mutex_unlock(&fs->aio_lock);
+
+    for (int i = 0; i < nreqs; i++) {
+        //reads on the ring may finish before ring_read returns, npending
+        //keeps the request from completing till its result is set
+        struct vs_aio *req = reqs[i];
+        req->result = 0;
+        req->npending = 1;
+        int result = -SIZE_ERR;
+        if (req->opcode == VS_AIO_READ)
+            result = ring_read(fs, req);
+        else if (req->opcode == VS_AIO_WRITE)
+            result = descr_write(fs, req->fd, req->offset, req->size, req->buffer, 0);
+
+        pthread_mutex_lock(&fs->aio_lock);
+        if (req->result == 0)
+            req->result = result;
+        if (--req->npending == 0)
+            aio_complete(fs, req, 1);
+        pthread_mutex_unlock(&fs->aio_lock);
+    }
+    return nreqs;
+}
+
+int vs_aio_poll(struct vsfs *fs, struct vs_aio **done, int max) {
+    return vs_aio_wait(fs, done, 0, max);
+}
+
+//waits till min requests finished or none is left in flight, hands back up to
+//max finished requests in done (unless it is NULL) and runs their callbacks
+int vs_aio_wait(struct vsfs *fs, struct vs_aio **done, int min, int max) {
+    struct vs_aio *head = NULL;
+    struct vs_aio **tail = &head;
+    int n = 0;
+
+    pthread_mutex_lock(&fs->aio_lock);
+    while (1) {
+        if (fs->aio_mode == VS_AIO_URING && !fs->ring_waiting)
+            ring_reap(fs);
+        while (n < max && fs->aio_done != NULL) {
+            struct vs_aio *req = fs->aio_done;
+            fs->aio_done = req->next;
+            if (fs->aio_done == NULL)
+                fs->aio_done_tail = NULL;
+            *tail = req;
+            tail = &req->next;
+            n++;
         }
+        if (n >= min || n >= max || fs->aio_outstanding == 0)
+            break;
+        aio_wait_done(fs);
     }
-    free(dirtab_buf);
-    if (id < 0) { 
-        free(stat);
+    pthread_mutex_unlock(&fs->aio_lock);
+    *tail = NULL;
+
+    for (int i = 0; head != NULL; i++) {
+        struct vs_aio *req = head;
+        head = req->next;
+        if (done != NULL)
+            done[i] = req;
+        if (req->callback != NULL)
+            req->callback(req);
+    }
+    return n;
+}
+
+int vs_aio_event_fd(struct vsfs *fs) {
+    int err = vs_aio_setup(fs, VS_AIO_URING);
+    if (err < 0)
+        return err;
+    return fs->aio_event_fd;
+}
+
+int vs_link(struct vsfs *fs, char *src_pathname, char *dest_pathname) {
+    STATS_BEGIN(probe);
+    ns_lock_all(fs);
+    int err = link_file(fs, src_pathname, dest_pathname);
+    ns_unlock_all(fs);
+    STATS_END(fs, probe, VS_OP_LINK, 0, err < 0);
+    return err;
+}
+
+int link_file(struct vsfs *fs, char *src_pathname, char *dest_pathname) {
+    if (dest_pathname[0] <= 0)
+        return -CREATE_ERR;
+
+    if (journal_check(fs) < 0)
+        return -WRITE_ERR;
+
+    if (dir_lookup(fs, dest_pathname) >= 0)
+        return -EXIST_ERR;
+
+    int src = dir_lookup(fs, src_pathname);
+    if (src < 0)
         return -NOTEXIST_ERR;
+
+    int id = fs->dirtab[src].id;
+    int i = dir_alloc_slot(fs);
+    if (i < 0)
+        return -MAXFILES_ERR;
+
+    struct inode *ino = inode_get(fs, id);
+    if (ino == NULL) {
+        dir_release_slot(fs, i);
+        return -READ_ERR;
     }
     struct dir_rec newrec = {
         .id = id
@@ -485,365 +2034,3169 @@ int vs_link(char *src_pathname, char *dest_pathname) {
     for (; j < MAX_NAMESIZE; j++)
         newrec.name[j] = 0;
 
-    stat->nlinks += 1;
-    
-    if (write_fstat(stat, id) < 0) {
-        free(stat);
+    if (write_dir_rec(fs, &newrec, i) < 0) {
+        dir_release_slot(fs, i);
+        inode_put(fs, ino);
         return -WRITE_ERR;
     }
+    fs->dirtab[i] = newrec;
+    dir_index_insert(fs, i);
 
-    if (write_dir_rec(&newrec, i) < 0) {
-        free(stat);
+    ino->stat.nlinks += 1;
+    ino->dirty = 1;
+    if (inode_put(fs, ino) < 0)
         return -WRITE_ERR;
-    }
-        
-    free(stat);
+
     return 0;
 }
 
-int vs_unlink(char *pathname) {
-    int dirtab_size = sizeof(struct dir_rec) * (h.nfiles_max + 1);
-    struct dir_rec *dirtab_buf = malloc(dirtab_size);
-    if (read_dirtab(dirtab_buf) < 0) {
-        free(dirtab_buf);
-        return -READ_ERR;
-    }
+int vs_unlink(struct vsfs *fs, char *pathname) {
+    STATS_BEGIN(probe);
+    ns_lock_all(fs);
+    int err = unlink_file(fs, pathname);
+    ns_unlock_all(fs);
+    STATS_END(fs, probe, VS_OP_UNLINK, 0, err < 0);
+    return err;
+}
 
-    struct fstat *stat = malloc(sizeof(struct fstat));
-    for (int i = 0; i < h.nfiles_max; i++) {
-        if (0 == strcmp(dirtab_buf[i].name, pathname)) {
-            if (vs_getstat(dirtab_buf[i].id, stat) < 0) {
-                free(dirtab_buf);
-                free(stat);
-                return -READ_ERR;
-            }
-            int id = dirtab_buf[i].id;
-            for (int j = 0; j < MAX_NAMESIZE; j++)
-                dirtab_buf[i].name[j] = '\0';
-
-            dirtab_buf[i].id = -1;
-            if (write_dir_rec(&dirtab_buf[i], i) < 0) {
-                free(dirtab_buf);
-                free(stat);
-                return -WRITE_ERR;
-            }
-            free(dirtab_buf);
-            stat->nlinks--;
-            if (stat->nlinks == 0) {
-                stat->ftype = -1;
-                stat->size = 0;
-                for (int j= 0; j < FILE_BLOCKS-1; j++) {
-                    free_block(stat->blocks_map[j]);
-                    stat->blocks_map[j] = -1;
-                }
+int unlink_file(struct vsfs *fs, char *pathname) {
+    if (journal_check(fs) < 0)
+        return -WRITE_ERR;
 
-                if (stat->blocks_map[FILE_BLOCKS-1] >= 0) {
-                    int *blocks = malloc(h.block_size);
-                    if (free_all_under_from(stat->blocks_map[FILE_BLOCKS-1], 0) < 0) {
-                        free(blocks);
-                        free(stat);
-                        return -WRITE_ERR;
-                    }
-                    free(blocks);
-                    stat->blocks_map[FILE_BLOCKS-1] = -1;
-                }
-            }
-            if (write_fstat(stat, id) < 0) {
-                free(stat);
-                return -WRITE_ERR;
-            }
-            free(stat);
-            return 0;
-        }
-    }
-    free(dirtab_buf);
-    free(stat);
-    return -NOTEXIST_ERR;
-}
+    int i = dir_lookup(fs, pathname);
+    if (i < 0)
+        return -NOTEXIST_ERR;
 
-int vs_truncate(char *pathname, int size) {
-    int dirtab_size = sizeof(struct dir_rec) * (h.nfiles_max + 1);
-    struct dir_rec *dirtab_buf = malloc(dirtab_size);
-    if (read_dirtab(dirtab_buf) < 0) {
-        free(dirtab_buf);
+    struct inode *ino = inode_get(fs, fs->dirtab[i].id);
+    if (ino == NULL)
         return -READ_ERR;
-    }
+    struct fstat *stat = &ino->stat;
 
-    struct fstat *stat = malloc(sizeof(struct fstat));
-    for (int i = 0; i < h.nfiles_max; i++) {
-        if (0 == strcmp(dirtab_buf[i].name, pathname)) {
-            if (vs_getstat(dirtab_buf[i].id, stat) < 0) {
-                free(dirtab_buf);
-                free(stat);
-                return -READ_ERR;
-            }
-            if (size < stat->size) {
-                int new_block_size = size / h.block_size;
-                int old_block_size = stat->size / h.block_size;
-
-                if (old_block_size < FILE_BLOCKS-1) {
-                    for (int i = new_block_size + 1; i < FILE_BLOCKS-1; i++) {
-                        if (stat->blocks_map[i] == -1) break;
-                        free_block(stat->blocks_map[i]);
-                        stat->blocks_map[i] = -1;
-                    }
-                } else {
-                    if (new_block_size < FILE_BLOCKS-1) {
-                        for (int i = new_block_size + 1; i < FILE_BLOCKS-1; i++) {
-                            free_block(stat->blocks_map[i]);
-                            stat->blocks_map[i] = -1;
-                        }
-                        free_all_under_from(stat->blocks_map[FILE_BLOCKS-1], 0);
-                        stat->blocks_map[FILE_BLOCKS-1] = -1;
-                    } else {
-                        free_all_under_from(stat->blocks_map[FILE_BLOCKS-1], new_block_size-FILE_BLOCKS+2);
-                    }
-                }
-                stat->size = size;
-                write_fstat(stat, dirtab_buf[i].id);
-                free(dirtab_buf);
-                free(stat);
-                return 0;
-            } else if (size > stat->size) {
-                int fd = vs_open(pathname);
-                if (fd < 0 || vs_write(fd, size - stat->size, 0, NULL) < 0) {
-                    free(dirtab_buf);
-                    free(stat);
-                    vs_close(fd);
-                    return -WRITE_ERR;
-                }
-                vs_close(fd);
-                free(dirtab_buf);
-                free(stat);
-                return 0;
-            } else {
-                free(dirtab_buf);
-                free(stat);
-                return 0;
-            }
-        }
+    struct dir_rec emptyrec = {
+        .id = -1
+    };
+    for (int j = 0; j < MAX_NAMESIZE; j++)
+        emptyrec.name[j] = '\0';
+
+    if (write_dir_rec(fs, &emptyrec, i) < 0) {
+        inode_put(fs, ino);
+        return -WRITE_ERR;
     }
-    free(dirtab_buf);
-    free(stat);
-    return -NOTEXIST_ERR;
-}
+    dir_index_remove(fs, i);
+    fs->dirtab[i] = emptyrec;
+    dir_release_slot(fs, i);
 
+    //blocks of a file left without links are freed by inode_put once it is closed
+    stat->nlinks--;
+    ino->dirty = 1;
+    if (inode_put(fs, ino) < 0)
+        return -WRITE_ERR;
 
-int next_descriptor() {
-    int i = 0;
-    for (i = 0; i < MAX_FILES_OPENED && descrs_tab[i] != -1; i++)
-        ;
-    if (i >= MAX_FILES_OPENED) return -1;
-    else return i;
+    return 0;
 }
 
-int next_free_block() {
-    int read_offset = sizeof(start_marker) + sizeof(struct header);
-
-    if (lseek(dev_id, read_offset, SEEK_SET) < 0)
-        return -READ_ERR;
-    
-
-    char *blocks_bitmap = malloc(h.nblocks * sizeof(char));
-    if (read(dev_id, blocks_bitmap, h.nblocks * sizeof(char)) < 0) {
-        free(blocks_bitmap);
-        return -READ_ERR;
-    }
-    int i;
-    for (i = 0; i < h.nblocks && blocks_bitmap[i] != 0; i++)
-        ;
-    free(blocks_bitmap);
-    if (i >= h.nblocks) return -1;
-    else return i;
+int vs_truncate(struct vsfs *fs, char *pathname, int size) {
+    STATS_BEGIN(probe);
+    ns_lock_all(fs);
+    int err = truncate_file(fs, pathname, size);
+    ns_unlock_all(fs);
+    STATS_END(fs, probe, VS_OP_TRUNCATE, 0, err < 0);
+    return err;
 }
 
-int occupy_block(int i) {
-    int write_offset = sizeof(start_marker)
-                       + sizeof(struct header)
-                       + i * sizeof(char);
-    char c;
-    if (lseek(dev_id, write_offset, SEEK_SET) < 0)
-        return -READ_ERR;
-    if (read(dev_id, &c, 1) < 0)
-        return -READ_ERR;
+int truncate_file(struct vsfs *fs, char *pathname, int size) {
+    if (journal_check(fs) < 0)
+        return -WRITE_ERR;
 
-    if (c) return -WRITE_ERR;
+    int i = dir_lookup(fs, pathname);
+    if (i < 0)
+        return -NOTEXIST_ERR;
 
-    char one = 1;
+    struct inode *ino = inode_get(fs, fs->dirtab[i].id);
+    if (ino == NULL)
+        return -READ_ERR;
+    struct fstat *stat = &ino->stat;
+    int nblocks = (size + fs->h.block_size - 1) / fs->h.block_size;
 
-    if (lseek(dev_id, write_offset, SEEK_SET) < 0)
+    //appends buffered past size are dropped, a hole can't be left before them
+    if (size < stat->size) {
+        da_trim(fs, ino, size);
+    } else if (size > stat->size && da_flush(fs, ino) < 0) {
+        inode_put(fs, ino);
         return -WRITE_ERR;
-    if (write(dev_id, &one, 1) < 0)
+    }
+
+    if (size < stat->size) {
+        if (bmap_truncate(fs, ino, nblocks) < 0 || zero_tail(fs, ino, size) < 0) {
+            inode_put(fs, ino);
+            return -WRITE_ERR;
+        }
+    } else if (size > stat->size) {
+        //file is extended with a hole, version 1 files can't be mapped past the indirect block
+        if (fs->version == FORMAT_BLOCKMAP
+                && nblocks > FILE_BLOCKS - 1 + fs->h.block_size / (int)sizeof(int)) {
+            inode_put(fs, ino);
+            return -WRITE_ERR;
+        }
+    }
+    if (size != stat->size) {
+        stat->size = size;
+        ino->dirty = 1;
+    }
+    if (inode_put(fs, ino) < 0)
         return -WRITE_ERR;
-    
     return 0;
 }
 
-int occupy_next_block() {
-    int new_blockid = next_free_block();
-    if (new_blockid < 0 || occupy_block(new_blockid) < 0)
-        return -EOF_ERR;
-                
-    return new_blockid;
-}
+//zeroes the last block of the file past size, so that growing the file again reads zeros there
+int zero_tail(struct vsfs *fs, struct inode *ino, int size) {
+    int tail = size % fs->h.block_size;
+    if (tail == 0)
+        return 0;
+
+    int run;
+    int blockid = bmap_lookup(fs, ino, size / fs->h.block_size, 1, &run);
+    if (blockid < 0)
+        return 0;
 
-int get_fstattab_offset() {
-    return sizeof(start_marker) 
-            + sizeof(struct header) 
-            + h.nblocks * sizeof(char);
+    char *zeros = calloc(fs->h.block_size - tail, 1);
+    int err = buf_write(fs, blockid, 1, tail, fs->h.block_size - tail, zeros, 0);
+    free(zeros);
+    return err < 0 ? -WRITE_ERR : 0;
 }
 
-int get_dirtab_offset() {
-    return sizeof(start_marker)
-            + sizeof(struct header)
-            + h.nblocks * sizeof(char)
-            + h.nfiles_max * sizeof(struct fstat);
+/*
+  Moves each file stored in more than one run of physically contiguous
+  blocks to the first free run long enough for all its data blocks. Data
+  is copied through the buffer cache, then the block map (direct entries
+  and the indirect block, or the extent list) is switched to the new blocks
+  and the old ones are freed; on journaled images this is one transaction,
+  so after a crash the file is found either at its old or its new place.
+  With VS_DEFRAG_COMPACT files in a single run are moved too when a free
+  run below them takes them, which gathers free space at the end of the
+  image. Files with no free run long enough are left as they are, frag is
+  set to the fragmentation after the moves.
+*/
+int vs_defrag(struct vsfs *fs, char *pathname, int flags, struct vs_frag *frag) {
+    ns_lock_all(fs);
+    int err = frag_walk(fs, pathname, flags, 1, frag);
+    ns_unlock_all(fs);
+    return err;
 }
 
-int get_blocks_offset() {
-    return sizeof(start_marker)
-            + sizeof(struct header)
-            + h.nblocks * sizeof(char)
-            + h.nfiles_max * sizeof(struct fstat)
-            + (h.nfiles_max + 1) * sizeof(struct dir_rec);
+//fragmentation of file pathname, or of all files when it is NULL
+int vs_fragstat(struct vsfs *fs, char *pathname, struct vs_frag *frag) {
+    ns_lock_all(fs);
+    int err = frag_walk(fs, pathname, 0, 0, frag);
+    ns_unlock_all(fs);
+    return err;
 }
 
-int read_dirtab(struct dir_rec *dirtab) {
-    int dirtab_size = sizeof(struct dir_rec) * (h.nfiles_max + 1);
+int frag_walk(struct vsfs *fs, char *pathname, int flags, int defrag, struct vs_frag *frag) {
+    memset(frag, 0, sizeof(*frag));
+    if (pathname != NULL) {
+        int i = dir_lookup(fs, pathname);
+        if (i < 0)
+            return -NOTEXIST_ERR;
+        return frag_file(fs, fs->dirtab[i].id, flags, defrag, frag);
+    }
 
-    if (lseek(dev_id, get_dirtab_offset(), SEEK_SET) < 0)
+    //file with several links is counted once
+    uint8_t *seen = calloc(fs->h.nfiles_max / 8 + 1, 1);
+    if (seen == NULL)
         return -READ_ERR;
-    if (read(dev_id, dirtab, dirtab_size) < 0)
-        return -READ_ERR;
-    return 0;
+    int err = 0;
+    for (int i = 0; i < fs->h.nfiles_max && err == 0; i++) {
+        int id = fs->dirtab[i].id;
+        if (id < 0 || id >= fs->h.nfiles_max || (seen[id / 8] & (1 << id % 8)))
+            continue;
+        seen[id / 8] |= 1 << id % 8;
+        err = frag_file(fs, id, flags, defrag, frag);
+        if (err == -EOF_ERR)
+            err = 0;
+    }
+    free(seen);
+    return err;
 }
 
-int read_fstattab(struct fstat *fstattab) {
-    int fstattab_size = sizeof(struct fstat) * h.nfiles_max;
-
-    if (lseek(dev_id, get_fstattab_offset(), SEEK_SET) < 0)
-        return -READ_ERR;
+//adds file id to frag, defragmenting it first when defrag is set
+int frag_file(struct vsfs *fs, int id, int flags, int defrag, struct vs_frag *frag) {
+    if (defrag && journal_check(fs) < 0)
+        return -WRITE_ERR;
 
-    if (read(dev_id, fstattab, fstattab_size) < 0)
+    struct inode *ino = inode_get(fs, id);
+    if (ino == NULL)
         return -READ_ERR;
 
-    return 0;
+    int err = defrag ? defrag_file(fs, ino, flags) : 0;
+    int nblocks, first;
+    int runs = file_runs(fs, ino, &nblocks, &first);
+    if (nblocks > 0) {
+        frag->files++;
+        frag->blocks += nblocks;
+        frag->runs += runs;
+        if (runs > 1)
+            frag->fragmented++;
+    }
+    if (inode_put(fs, ino) < 0 && err == 0)
+        err = -WRITE_ERR;
+    return err;
 }
 
-int write_fstat(struct fstat *stat, int id) {
-    if (lseek(dev_id, get_fstattab_offset() + id * sizeof(struct fstat), SEEK_SET) < 0
-            || write(dev_id, stat, sizeof(struct fstat)) < 0)
-        return -WRITE_ERR;
-    
-    return 0;
+//number of runs of physically contiguous blocks holding the data of the file in
+//logical order, *nblocks is set to its data blocks and *first to the first of them
+int file_runs(struct vsfs *fs, struct inode *ino, int *nblocks, int *first) {
+    int lblocks = (ino->stat.size + fs->h.block_size - 1) / fs->h.block_size;
+    int runs = 0;
+    int end = -1;
+    *nblocks = 0;
+    *first = -1;
+    for (int l = 0, run; l < lblocks; l += run) {
+        int blockid = bmap_lookup(fs, ino, l, lblocks - l, &run);
+        if (blockid < 0)
+            continue;
+        if (blockid != end)
+            runs++;
+        if (*first < 0)
+            *first = blockid;
+        *nblocks += run;
+        end = blockid + run;
+    }
+    return runs;
 }
 
-int write_dir_rec(struct dir_rec *dirrec, int i) {
-    if (lseek(dev_id, get_dirtab_offset() + i*sizeof(struct dir_rec), SEEK_SET) < 0
-            || write(dev_id, dirrec, sizeof(struct dir_rec)) < 0)
+//moves the data blocks of the file to one free run, -EOF_ERR if there is none
+int defrag_file(struct vsfs *fs, struct inode *ino, int flags) {
+    if (da_flush(fs, ino) < 0)
         return -WRITE_ERR;
 
-    return 0;
-}
+    int nblocks, first;
+    int runs = file_runs(fs, ino, &nblocks, &first);
+    if (runs == 0 || (runs == 1 && !(flags & VS_DEFRAG_COMPACT)))
+        return 0;
 
-int get_block_id(struct fstat *stat, int block_offset, int create) {
-    if (block_offset < FILE_BLOCKS-1) {
-        int id = stat->blocks_map[block_offset];
-        if (id >= 0 || !create) {
-            return id;
-        } else {
-            int new_blockid = occupy_next_block();
-            if (new_blockid < 0) return -EOF_ERR;
-            stat->blocks_map[block_offset] = new_blockid;
-            return new_blockid;
-        }
-    } else {
-        if (block_offset-FILE_BLOCKS+1 >= h.block_size / sizeof(int))
-            return -EOF_ERR;
-            
-        if (stat->blocks_map[FILE_BLOCKS-1] < 0) {
-            if (!create) {
-                return -EOF_ERR;
+    //blocks reserved for buffered appends of other files are left to them, blocks
+    //freed by files moved before become free once their transaction commits
+    int start = -1;
+    for (int pass = 0; pass < 2 && start < 0; pass++) {
+        if (pass > 0 && (fs->jnfree == 0 || journal_commit(fs) < 0))
+            break;
+        pthread_mutex_lock(&fs->alloc_lock);
+        if (fs->bitmap_nfree - fs->da_reserved >= nblocks)
+            start = find_free_run(fs, nblocks, runs == 1 ? first : fs->h.nblocks);
+        if (start >= 0)
+            occupy_run(fs, start, nblocks);
+        pthread_mutex_unlock(&fs->alloc_lock);
+    }
+    if (start < 0)
+        return runs == 1 ? 0 : -EOF_ERR;
+
+    //mapped runs are copied in logical order, old ones are remembered to be freed
+    int bs = fs->h.block_size;
+    int chunk = DEFRAG_CHUNK / bs > 0 ? DEFRAG_CHUNK / bs : 1;
+    int lblocks = (ino->stat.size + bs - 1) / bs;
+    struct extent *old = malloc(nblocks * sizeof(struct extent));
+    char *data = malloc((size_t)chunk * bs);
+    int nold = 0;
+    int err = old == NULL || data == NULL ? -WRITE_ERR : 0;
+    for (int l = 0, run, dst = start; l < lblocks && err == 0; l += run) {
+        int max = lblocks - l < chunk ? lblocks - l : chunk;
+        int blockid = bmap_lookup(fs, ino, l, max, &run);
+        if (blockid < 0)
+            continue;
+        if (buf_read(fs, blockid, run, 0, run * bs, data) < run * bs
+                || buf_write(fs, dst, run, 0, run * bs, data, 1) < run * bs)
+            err = -WRITE_ERR;
+        old[nold].start = blockid;
+        old[nold++].len = run;
+        dst += run;
+    }
+    free(data);
+
+    if (fs->version == FORMAT_BLOCKMAP) {
+        //indirect block is got before any entry changes, so the map is switched whole or not at all
+        pthread_mutex_lock(&fs->buf_lock);
+        struct fstat *stat = &ino->stat;
+        struct buf *b = NULL;
+        if (lblocks > FILE_BLOCKS-1 && stat->blocks_map[FILE_BLOCKS-1] >= 0
+                && (b = buf_get(fs, stat->blocks_map[FILE_BLOCKS-1], 1)) == NULL)
+            err = -WRITE_ERR;
+        for (int l = 0, dst = start; l < lblocks && err == 0; l++) {
+            if (get_block_id(fs, stat, l, 0) < 0)
+                continue;
+            if (l < FILE_BLOCKS-1) {
+                stat->blocks_map[l] = dst++;
             } else {
-                int new_blockid = occupy_next_block();
-                if (new_blockid < 0) return -EOF_ERR;
-                stat->blocks_map[FILE_BLOCKS-1] = new_blockid;
-                int *blocks = malloc(h.block_size);
-                blocks[0] = occupy_next_block();
-                for (int i = 1; i < h.block_size/sizeof(int); i++)
-                    blocks[i] = -1;
-                
-                if (lseek(dev_id, get_blocks_offset() + new_blockid*h.block_size, SEEK_SET) < 0
-                        || write(dev_id, blocks, h.block_size) < 0) {
-                    free(blocks);
-                    return -WRITE_ERR;
-                }
-                free(blocks);
+                ((int *)b->data)[l-FILE_BLOCKS+1] = dst++;
+                b->meta = 1;
+                b->dirty = 1;
             }
         }
-
-        int *blocks = malloc(h.block_size);
-        int read_offset = 
-                get_blocks_offset() + stat->blocks_map[FILE_BLOCKS-1] * h.block_size;
-        if (lseek(dev_id, read_offset, SEEK_SET) < 0 
-                || read(dev_id, blocks, h.block_size) < 0) {
-            free(blocks);
-            return -READ_ERR;
+        pthread_mutex_unlock(&fs->buf_lock);
+        ino->dirty = 1;
+    } else {
+        //holes keep their place in the list, the moved extents merge into one,
+        //blocks mapped past the end of file (not copied) stay where they are
+        struct extent *ext = ino->ext;
+        int next_ext = ino->next_ext;
+        int ext_cap = ino->ext_cap;
+        ino->ext = NULL;
+        ino->next_ext = ino->ext_cap = 0;
+        for (int i = 0, l = 0, dst = start; i < next_ext && err == 0; l += ext[i++].len) {
+            int moved = ext[i].start < 0 || l >= lblocks ? 0
+                        : lblocks - l < ext[i].len ? lblocks - l : ext[i].len;
+            if ((moved > 0 && ext_append(ino, dst, moved) < 0)
+                    || (moved < ext[i].len && ext_append(ino, ext[i].start < 0 ? -1 : ext[i].start + moved,
+                                                         ext[i].len - moved) < 0))
+                err = -WRITE_ERR;
+            dst += moved;
         }
-        int id = blocks[block_offset-FILE_BLOCKS+1];
-        if (id >= 0 || !create) {
-            free(blocks);
-            return id;
+        if (err < 0) {
+            free(ino->ext);
+            ino->ext = ext;
+            ino->next_ext = next_ext;
+            ino->ext_cap = ext_cap;
         } else {
-            int new_blockid = occupy_next_block();
-            blocks[block_offset-FILE_BLOCKS+1] = new_blockid;
-            if (lseek(dev_id, get_blocks_offset()+stat->blocks_map[FILE_BLOCKS-1]*h.block_size, SEEK_SET) < 0
-                    || write(dev_id, blocks, h.block_size) < 0) {
-                free(blocks);
-                return -WRITE_ERR;
-            }
-            free(blocks);
-            return new_blockid;
+            free(ext);
+            __atomic_store_n(&ino->ext_hint, 0, __ATOMIC_RELAXED);
+            ino->ext_dirty = 1;
         }
     }
+
+    //on failure the file still maps its old blocks and the copies are dropped
+    for (int i = 0; i < nold && err == 0; i++) {
+        for (int b = old[i].start; b < old[i].start + old[i].len; b++)
+            free_block(fs, b);
+    }
+    if (err < 0) {
+        for (int b = start; b < start + nblocks; b++)
+            free_block(fs, b);
+    }
+    free(old);
+    return err;
 }
 
-int free_block(int blockid) {
-    if (blockid < 0) {
+//first free run of want blocks starting below limit or -1
+int find_free_run(struct vsfs *fs, int want, int limit) {
+    int i = 0;
+    while ((i = find_free_block(fs, i, limit)) >= 0) {
+        int len = free_run_length(fs, i, want);
+        if (len == want)
+            return i;
+        i += len;
+    }
+    return -1;
+}
+
+//block size is a power of two in [BLOCK_SIZE, MAX_BLOCK_SIZE]
+int valid_block_size(int block_size) {
+    return block_size >= BLOCK_SIZE
+           && block_size <= MAX_BLOCK_SIZE
+           && (block_size & (block_size - 1)) == 0;
+}
+
+struct descr *descr_at(struct vsfs *fs, int index) {
+    struct descr *seg = __atomic_load_n(&fs->descr_segs[index / DESCR_SEG_SIZE], __ATOMIC_ACQUIRE);
+    return &seg[index % DESCR_SEG_SIZE];
+}
+
+//entry of an open descriptor, NULL if fd is not open or was closed since
+struct descr *descr_get(struct vsfs *fs, int fd) {
+    int index = fd & DESCR_INDEX_MASK;
+    if (fd < 0 || index >= __atomic_load_n(&fs->ndescrs, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    struct descr *d = descr_at(fs, index);
+    if ((__atomic_load_n(&d->gen, __ATOMIC_ACQUIRE) & DESCR_GEN_MASK) != (uint32_t)fd >> DESCR_INDEX_BITS
+            || __atomic_load_n(&d->id, __ATOMIC_ACQUIRE) == -1)
+        return NULL;
+    return d;
+}
+
+int descr_fd(struct descr *d, int index) {
+    return (int)((__atomic_load_n(&d->gen, __ATOMIC_RELAXED) & DESCR_GEN_MASK) << DESCR_INDEX_BITS) | index;
+}
+
+//takes an unused entry off the free stack, growing the table when it is empty
+int descr_pop(struct vsfs *fs) {
+    uint64_t head = __atomic_load_n(&fs->descr_head, __ATOMIC_ACQUIRE);
+    while (1) {
+        uint32_t index = (uint32_t)head;
+        if (index == DESCR_NONE) {
+            if (descr_grow(fs) < 0)
+                return -1;
+            head = __atomic_load_n(&fs->descr_head, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        uint32_t next_index = __atomic_load_n(&descr_at(fs, index)->next_free, __ATOMIC_RELAXED);
+        uint64_t next = (((head >> 32) + 1) << 32) | next_index;
+        if (__atomic_compare_exchange_n(&fs->descr_head, &head, next, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return index;
+    }
+}
+
+//pushes entries from index first to last, linked through next_free, on the free stack
+void descr_push(struct vsfs *fs, int first, struct descr *last) {
+    uint64_t head = __atomic_load_n(&fs->descr_head, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    do {
+        __atomic_store_n(&last->next_free, (uint32_t)head, __ATOMIC_RELAXED);
+        next = (((head >> 32) + 1) << 32) | (uint32_t)first;
+    } while (!__atomic_compare_exchange_n(&fs->descr_head, &head, next, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+//adds a segment of unused entries unless another thread did it meanwhile
+int descr_grow(struct vsfs *fs) {
+    int err = 0;
+    pthread_mutex_lock(&fs->descr_grow_lock);
+    if ((uint32_t)__atomic_load_n(&fs->descr_head, __ATOMIC_ACQUIRE) == DESCR_NONE) {
+        int nsegs = fs->ndescrs / DESCR_SEG_SIZE;
+        struct descr *seg = nsegs < DESCR_MAX_SEGS ? malloc(DESCR_SEG_SIZE * sizeof(struct descr)) : NULL;
+        if (seg == NULL) {
+            err = -1;
+        } else {
+            //entries are linked in order, so that lower descriptors are handed out first
+            int first = fs->ndescrs;
+            for (int i = 0; i < DESCR_SEG_SIZE; i++) {
+                seg[i].id = -1;
+                seg[i].gen = 0;
+                seg[i].ino = NULL;
+                seg[i].pos = 0;
+                seg[i].next_free = first + i + 1;
+            }
+            __atomic_store_n(&fs->descr_segs[nsegs], seg, __ATOMIC_RELEASE);
+            __atomic_store_n(&fs->ndescrs, first + DESCR_SEG_SIZE, __ATOMIC_RELEASE);
+            descr_push(fs, first, &seg[DESCR_SEG_SIZE - 1]);
+        }
+    }
+    pthread_mutex_unlock(&fs->descr_grow_lock);
+    return err;
+}
+
+void descr_table_free(struct vsfs *fs) {
+    for (int i = 0; i < fs->ndescrs / DESCR_SEG_SIZE; i++)
+        free(fs->descr_segs[i]);
+    fs->ndescrs = 0;
+}
+
+void locks_init(struct vsfs *fs) {
+    for (int i = 0; i < NS_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&fs->ns_locks[i].lock, NULL);
+        pthread_mutex_init(&fs->ns_locks[i].gate, NULL);
+    }
+    pthread_mutex_init(&fs->icache_lock, NULL);
+    pthread_mutex_init(&fs->alloc_lock, NULL);
+    pthread_mutex_init(&fs->jlock, NULL);
+    pthread_mutex_init(&fs->descr_grow_lock, NULL);
+    pthread_mutex_init(&fs->aio_lock, NULL);
+    pthread_mutex_init(&fs->dev_lock, NULL);
+    pthread_cond_init(&fs->aio_queue_cond, NULL);
+    pthread_cond_init(&fs->aio_done_cond, NULL);
+
+    //buffer cache users nest: a frame is held while blocks get freed or written back
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&fs->buf_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void locks_destroy(struct vsfs *fs) {
+    for (int i = 0; i < NS_LOCK_STRIPES; i++) {
+        pthread_rwlock_destroy(&fs->ns_locks[i].lock);
+        pthread_mutex_destroy(&fs->ns_locks[i].gate);
+    }
+    pthread_mutex_destroy(&fs->icache_lock);
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_mutex_destroy(&fs->buf_lock);
+    pthread_mutex_destroy(&fs->jlock);
+    pthread_mutex_destroy(&fs->descr_grow_lock);
+    pthread_mutex_destroy(&fs->aio_lock);
+    pthread_mutex_destroy(&fs->dev_lock);
+    pthread_cond_destroy(&fs->aio_queue_cond);
+    pthread_cond_destroy(&fs->aio_done_cond);
+}
+
+void ns_lock_shared(struct vsfs *fs, unsigned int key) {
+    struct ns_lock *l = &fs->ns_locks[key & (NS_LOCK_STRIPES - 1)];
+    pthread_mutex_lock(&l->gate);
+    pthread_rwlock_rdlock(&l->lock);
+    pthread_mutex_unlock(&l->gate);
+}
+
+void ns_unlock_shared(struct vsfs *fs, unsigned int key) {
+    pthread_rwlock_unlock(&fs->ns_locks[key & (NS_LOCK_STRIPES - 1)].lock);
+}
+
+void ns_lock_exclusive(struct vsfs *fs, unsigned int key) {
+    struct ns_lock *l = &fs->ns_locks[key & (NS_LOCK_STRIPES - 1)];
+    pthread_mutex_lock(&l->gate);
+    pthread_rwlock_wrlock(&l->lock);
+    pthread_mutex_unlock(&l->gate);
+}
+
+void ns_unlock_exclusive(struct vsfs *fs, unsigned int key) {
+    pthread_rwlock_unlock(&fs->ns_locks[key & (NS_LOCK_STRIPES - 1)].lock);
+}
+
+//stripes are always taken in the same order
+void ns_lock_all(struct vsfs *fs) {
+    for (int i = 0; i < NS_LOCK_STRIPES; i++)
+        ns_lock_exclusive(fs, i);
+}
+
+void ns_unlock_all(struct vsfs *fs) {
+    for (int i = NS_LOCK_STRIPES - 1; i >= 0; i--)
+        pthread_rwlock_unlock(&fs->ns_locks[i].lock);
+}
+
+//with aio_lock held
+int aio_setup(struct vsfs *fs, int mode) {
+    fs->aio_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fs->aio_event_fd < 0)
+        return -OPEN_ERR;
+
+    //a mapped image has no image I/O to put on the ring
+    if (mode != VS_AIO_THREADS && fs->dev_map == NULL && ring_setup(fs) == 0) {
+        mode = VS_AIO_URING;
+    } else {
+        mode = VS_AIO_THREADS;
+        fs->aio_stop = 0;
+        for (int i = 0; i < AIO_WORKERS; i++) {
+            if (pthread_create(&fs->aio_workers[i], NULL, aio_worker, fs) != 0)
+                break;
+            fs->naio_workers++;
+        }
+        if (fs->naio_workers == 0) {
+            close(fs->aio_event_fd);
+            return -OPEN_ERR;
+        }
+    }
+    __atomic_store_n(&fs->aio_mode, mode, __ATOMIC_RELEASE);
+    return mode;
+}
+
+//lets requests in flight finish, the ones not collected by then are dropped
+void aio_shutdown(struct vsfs *fs) {
+    if (fs->aio_mode == 0)
+        return;
+
+    if (fs->aio_mode == VS_AIO_THREADS) {
+        pthread_mutex_lock(&fs->aio_lock);
+        fs->aio_stop = 1;
+        pthread_cond_broadcast(&fs->aio_queue_cond);
+        pthread_mutex_unlock(&fs->aio_lock);
+        for (int i = 0; i < fs->naio_workers; i++)
+            pthread_join(fs->aio_workers[i], NULL);
+        fs->naio_workers = 0;
+    } else {
+        aio_drain(fs);
+        ring_free(fs);
+    }
+    close(fs->aio_event_fd);
+    fs->aio_queue = fs->aio_queue_tail = NULL;
+    fs->aio_done = fs->aio_done_tail = NULL;
+    fs->aio_outstanding = 0;
+    fs->aio_mode = 0;
+}
+
+//runs queued requests until aio_shutdown, the queue is emptied first
+void *aio_worker(void *arg) {
+    struct vsfs *fs = arg;
+
+    pthread_mutex_lock(&fs->aio_lock);
+    while (1) {
+        struct vs_aio *req = fs->aio_queue;
+        if (req == NULL) {
+            if (fs->aio_stop)
+                break;
+            pthread_cond_wait(&fs->aio_queue_cond, &fs->aio_lock);
+            continue;
+        }
+        fs->aio_queue = req->next;
+        if (fs->aio_queue == NULL)
+            fs->aio_queue_tail = NULL;
+        pthread_mutex_unlock(&fs->aio_lock);
+
+        int result = -SIZE_ERR;
+        if (req->opcode == VS_AIO_READ)
+            result = descr_read(fs, req->fd, req->offset, req->size, req->buffer, 0);
+        else if (req->opcode == VS_AIO_WRITE)
+            result = descr_write(fs, req->fd, req->offset, req->size, req->buffer, 0);
+
+        pthread_mutex_lock(&fs->aio_lock);
+        req->result = result;
+        aio_complete(fs, req, 1);
+    }
+    pthread_mutex_unlock(&fs->aio_lock);
+    return NULL;
+}
+
+//queues req for collection, with aio_lock held. The event fd is signalled when
+//the queue stops being empty, the kernel does it for reads on the ring (notify 0)
+void aio_complete(struct vsfs *fs, struct vs_aio *req, int notify) {
+    req->next = NULL;
+    if (fs->aio_done_tail != NULL) {
+        fs->aio_done_tail->next = req;
+    } else {
+        fs->aio_done = req;
+        if (notify)
+            eventfd_write(fs->aio_event_fd, 1);
+    }
+    fs->aio_done_tail = req;
+    fs->aio_outstanding--;
+    pthread_cond_broadcast(&fs->aio_done_cond);
+}
+
+//waits for some request to make progress, with aio_lock held
+void aio_wait_done(struct vsfs *fs) {
+    if (fs->aio_mode != VS_AIO_URING || fs->ring_waiting || fs->aio_inflight == 0) {
+        pthread_cond_wait(&fs->aio_done_cond, &fs->aio_lock);
+        return;
+    }
+
+    fs->ring_waiting = 1;
+    pthread_mutex_unlock(&fs->aio_lock);
+    syscall(__NR_io_uring_enter, fs->ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    pthread_mutex_lock(&fs->aio_lock);
+    fs->ring_waiting = 0;
+    ring_reap(fs);
+    pthread_cond_broadcast(&fs->aio_done_cond);
+}
+
+//waits for all reads handed to the kernel
+void aio_drain(struct vsfs *fs) {
+    if (__atomic_load_n(&fs->aio_inflight, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    pthread_mutex_lock(&fs->aio_lock);
+    while (fs->aio_inflight > 0) {
+        if (!fs->ring_waiting)
+            ring_reap(fs);
+        if (fs->aio_inflight > 0)
+            aio_wait_done(fs);
+    }
+    pthread_mutex_unlock(&fs->aio_lock);
+}
+
+/*
+  Sets up an io_uring through the raw syscalls. The kernel has to support
+  IORING_OP_READ, which came together with IORING_FEAT_RW_CUR_POS. The
+  event fd is registered with the ring, so the kernel signals it for every
+  completion.
+*/
+int ring_setup(struct vsfs *fs) {
+    struct aio_ring *r = &fs->ring;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+
+    r->fd = syscall(__NR_io_uring_setup, AIO_RING_ENTRIES, &p);
+    if (r->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        ring_free(fs);
+        return -1;
+    }
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && r->cq_map_size > r->sq_map_size)
+        r->sq_map_size = r->cq_map_size;
+
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED)
+        r->sq_map = NULL;
+    if (single)
+        r->cq_map = r->sq_map;
+    else if ((r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        r->cq_map = NULL;
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if ((r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        r->fd, IORING_OFF_SQES)) == MAP_FAILED)
+        r->sqes = NULL;
+    if (r->sq_map == NULL || r->cq_map == NULL || r->sqes == NULL
+            || syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_EVENTFD, &fs->aio_event_fd, 1) < 0) {
+        ring_free(fs);
+        return -1;
+    }
+
+    char *sq = r->sq_map;
+    char *cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->cq_entries = p.cq_entries;
+    return 0;
+}
+
+void ring_free(struct vsfs *fs) {
+    struct aio_ring *r = &fs->ring;
+    if (r->sqes != NULL)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_map != NULL && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map != NULL)
+        munmap(r->sq_map, r->sq_map_size);
+    close(r->fd);
+    memset(r, 0, sizeof(*r));
+}
+
+/*
+  Starts a read request: holes and blocks in the buffer cache are copied to
+  the request buffer right away, physically contiguous blocks missing from
+  it are read from the image on the ring straight into the buffer. Returns
+  the size the request will have read or an error.
+*/
+int ring_read(struct vsfs *fs, struct vs_aio *req) {
+    ns_lock_shared(fs, req->fd);
+    struct descr *d = descr_get(fs, req->fd);
+    if (d == NULL) {
+        ns_unlock_shared(fs, req->fd);
+        return -BADDESC_ERR;
+    }
+    struct inode *ino = d->ino;
+    pthread_rwlock_rdlock(&ino->lock);
+
+    int bs = fs->h.block_size;
+    int offset = req->offset;
+    int size = req->size;
+    if (offset >= ino->stat.size)
+        size = 0;
+    else if (size > ino->stat.size - offset)
+        size = ino->stat.size - offset;
+
+    struct aio_piece pieces[AIO_PIECES];
+    int npieces = 0;
+    int block_offset = offset / bs;
+    int byte_offset = offset - block_offset * bs;
+    int done = 0;
+    while (done < size) {
+        int nleft = (byte_offset + size - done + bs - 1) / bs;
+        int run;
+        int blockid = bmap_lookup(fs, ino, block_offset, nleft, &run);
+
+        int len = run * bs - byte_offset;
+        if (len > size - done)
+            len = size - done;
+
+        if (blockid < 0) {
+            memset(req->buffer + done, 0, len);
+            done += len;
+            byte_offset = 0;
+            block_offset += run;
+            continue;
+        }
+
+        //cached blocks may be newer than the image, so they are copied from the cache
+        pthread_mutex_lock(&fs->buf_lock);
+        for (int i = 0, pos = 0; pos < len; i++) {
+            int skip = i == 0 ? byte_offset : 0;
+            int n = bs - skip < len - pos ? bs - skip : len - pos;
+            char *dst = req->buffer + done + pos;
+            pos += n;
+
+            struct buf *b = buf_find(fs, blockid + i);
+            if (b != NULL) {
+                fs->cache_stats.hits++;
+                b->ref = 1;
+                memcpy(dst, b->data + skip, n);
+                continue;
+            }
+
+            fs->cache_stats.misses++;
+            off_t dev_offset = get_blocks_offset(fs) + (off_t)(blockid + i) * bs + skip;
+            struct aio_piece *last = npieces > 0 ? &pieces[npieces - 1] : NULL;
+            if (last != NULL && last->offset + last->len == dev_offset && last->dst + last->len == dst) {
+                last->len += n;
+                continue;
+            }
+            if (npieces == AIO_PIECES) {
+                pthread_mutex_unlock(&fs->buf_lock);
+                ring_queue(fs, req, pieces, npieces);
+                pthread_mutex_lock(&fs->buf_lock);
+                npieces = 0;
+            }
+            pieces[npieces].dst = dst;
+            pieces[npieces].len = n;
+            pieces[npieces].offset = dev_offset;
+            npieces++;
+        }
+        pthread_mutex_unlock(&fs->buf_lock);
+
+        done += len;
+        byte_offset = 0;
+        block_offset += run;
+    }
+
+    //reads are handed to the kernel before the file lock is dropped, so
+    //that blocks of the file can't be freed while reads of them are queued
+    if (npieces > 0)
+        ring_queue(fs, req, pieces, npieces);
+    da_read(fs, ino, offset, size, req->buffer);
+    pthread_rwlock_unlock(&ino->lock);
+    ns_unlock_shared(fs, req->fd);
+    return size;
+}
+
+//puts reads of pieces on the ring and submits them
+void ring_queue(struct vsfs *fs, struct vs_aio *req, struct aio_piece *pieces, int n) {
+    struct aio_ring *r = &fs->ring;
+
+    pthread_mutex_lock(&fs->aio_lock);
+    unsigned queued = 0;
+    for (int i = 0; i < n; i++) {
+        //completions of everything in flight have to fit the completion queue
+        while (queued == r->sq_entries || fs->aio_inflight + queued >= r->cq_entries) {
+            if (queued > 0) {
+                ring_submit(fs, queued);
+                queued = 0;
+            } else {
+                aio_wait_done(fs);
+            }
+        }
+
+        unsigned tail = *r->sq_tail;
+        unsigned index = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fs->dev_id;
+        sqe->addr = (uint64_t)(uintptr_t)pieces[i].dst;
+        sqe->len = pieces[i].len;
+        sqe->off = pieces[i].offset;
+        sqe->user_data = (uint64_t)(uintptr_t)req;
+        r->sq_array[index] = index;
+        __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        req->npending++;
+        queued++;
+    }
+    if (queued > 0)
+        ring_submit(fs, queued);
+    pthread_mutex_unlock(&fs->aio_lock);
+}
+
+//hands n queued entries to the kernel, with aio_lock held. Without SQPOLL the
+//kernel takes entries only within io_uring_enter, so the ones it refused are
+//taken back and fail their requests
+void ring_submit(struct vsfs *fs, int n) {
+    struct aio_ring *r = &fs->ring;
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, n, 0, 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0)
+        ret = 0;
+    __atomic_fetch_add(&fs->aio_inflight, ret, __ATOMIC_RELEASE);
+
+    unsigned tail = *r->sq_tail;
+    for (int i = ret; i < n; i++) {
+        tail--;
+        struct vs_aio *req = (struct vs_aio *)(uintptr_t)r->sqes[tail & *r->sq_mask].user_data;
+        req->result = -READ_ERR;
+        if (--req->npending == 0)
+            aio_complete(fs, req, 1);
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+//collects completions of the ring, with aio_lock held
+void ring_reap(struct vsfs *fs) {
+    struct aio_ring *r = &fs->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct vs_aio *req = (struct vs_aio *)(uintptr_t)cqe->user_data;
+        if (cqe->res < 0)
+            req->result = -READ_ERR;
+        __atomic_fetch_sub(&fs->aio_inflight, 1, __ATOMIC_RELEASE);
+        if (--req->npending == 0)
+            aio_complete(fs, req, 0);
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+//first free block in [from, to) or -1
+int find_free_block(struct vsfs *fs, int from, int to) {
+    if (from >= to) return -1;
+
+    int w = from / 64;
+    uint64_t free_bits = ~fs->bitmap[w] & (~(uint64_t)0 << (from % 64));
+    while (1) {
+        if (free_bits) {
+            int i = w * 64 + __builtin_ctzll(free_bits);
+            return i < to ? i : -1;
+        }
+        if (++w * 64 >= to) return -1;
+        free_bits = ~fs->bitmap[w];
+    }
+}
+
+//number of free blocks starting from block i, counting stops at max
+int free_run_length(struct vsfs *fs, int i, int max) {
+    int len = 0;
+    while (len < max && i + len < fs->h.nblocks) {
+        int b = i + len;
+        uint64_t used = fs->bitmap[b / 64] >> (b % 64);
+        int avail = used ? __builtin_ctzll(used) : 64 - b % 64;
+        len += avail;
+        if (avail < 64 - b % 64) break;
+    }
+    if (len > max) len = max;
+    if (len > fs->h.nblocks - i) len = fs->h.nblocks - i;
+    return len;
+}
+
+void occupy_run(struct vsfs *fs, int start, int len) {
+    for (int i = start; i < start + len; i++)
+        fs->bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+    fs->bitmap_nfree -= len;
+    mark_bitmap_dirty(fs, start);
+    mark_bitmap_dirty(fs, start + len - 1);
+}
+
+/*
+  Allocates up to want physically contiguous blocks and returns the first
+  one, *got is set to the number of blocks taken. Run at goal is taken when
+  goal is free, otherwise free runs are scanned from bitmap_hint and the
+  first one long enough is taken, or the longest of ALLOC_SCAN_RUNS seen.
+*/
+int alloc_run(struct vsfs *fs, int want, int goal, int *got) {
+    int best = -1;
+    int best_len = 0;
+
+    if (goal >= 0 && goal < fs->h.nblocks) {
+        best_len = free_run_length(fs, goal, want);
+        if (best_len > 0) best = goal;
+    }
+
+    int nruns = 0;
+    for (int pass = 0; pass < 2 && best_len < want && nruns < ALLOC_SCAN_RUNS; pass++) {
+        int from = pass == 0 ? fs->bitmap_hint : 0;
+        int to = pass == 0 ? fs->h.nblocks : fs->bitmap_hint;
+        int i;
+        while (best_len < want && nruns++ < ALLOC_SCAN_RUNS
+                && (i = find_free_block(fs, from, to)) >= 0) {
+            int len = free_run_length(fs, i, want);
+            if (len > best_len) {
+                best = i;
+                best_len = len;
+            }
+            from = i + len;
+        }
+    }
+    if (best < 0) return -1;
+
+    occupy_run(fs, best, best_len);
+    fs->bitmap_hint = best + best_len < fs->h.nblocks ? best + best_len : 0;
+    *got = best_len;
+    return best;
+}
+
+int occupy_next_block(struct vsfs *fs) {
+    STATS_BEGIN(probe);
+    int got;
+    int new_blockid = alloc_run(fs, 1, -1, &got);
+    STATS_END(fs, probe, VS_OP_OCCUPY_NEXT_BLOCK, 0, new_blockid < 0);
+    if (new_blockid < 0)
+        return -EOF_ERR;
+                
+    return new_blockid;
+}
+
+off_t get_fstattab_offset(struct vsfs *fs) {
+    return fs->fstattab_offset;
+}
+
+off_t get_dirtab_offset(struct vsfs *fs) {
+    return fs->dirtab_offset;
+}
+
+off_t get_blocks_offset(struct vsfs *fs) {
+    return fs->blocks_offset;
+}
+
+int read_dirtab(struct vsfs *fs, struct dir_rec *dirtab) {
+    STATS_BEGIN(probe);
+    int dirtab_size = sizeof(struct dir_rec) * (fs->h.nfiles_max + 1);
+
+    int n = dev_read(fs, dirtab, dirtab_size, get_dirtab_offset(fs));
+    STATS_END(fs, probe, VS_OP_READ_DIRTAB, n > 0 ? n : 0, n < 0);
+    if (n < 0)
+        return -READ_ERR;
+    return 0;
+}
+
+int read_fstattab(struct vsfs *fs, struct fstat *fstattab) {
+    int fstattab_size = sizeof(struct fstat) * fs->h.nfiles_max;
+
+    if (dev_read(fs, fstattab, fstattab_size, get_fstattab_offset(fs)) < 0)
+        return -READ_ERR;
+
+    return 0;
+}
+
+int write_fstat(struct vsfs *fs, struct fstat *stat, int id) {
+    STATS_BEGIN(probe);
+    int err = meta_write(fs, stat, sizeof(struct fstat), get_fstattab_offset(fs) + (off_t)id * sizeof(struct fstat));
+    STATS_END(fs, probe, VS_OP_WRITE_FSTAT, err < 0 ? 0 : sizeof(struct fstat), err < 0);
+    if (err < 0)
+        return -WRITE_ERR;
+    
+    return 0;
+}
+
+//during a batch the record is written later from dirtab by flush_dirtab
+int write_dir_rec(struct vsfs *fs, struct dir_rec *dirrec, int i) {
+    if (fs->batch) {
+        if (i < fs->dir_dirty_lo) fs->dir_dirty_lo = i;
+        if (i + 1 > fs->dir_dirty_hi) fs->dir_dirty_hi = i + 1;
         return 0;
     }
-    int write_offset = sizeof(start_marker)
-                        + sizeof(struct header)
-                        + blockid * sizeof(char);
-    char c = 0;
-    if (lseek(dev_id, write_offset, SEEK_SET) < 0 || write(dev_id, &c, 1) < 0)
+
+    if (meta_write(fs, dirrec, sizeof(struct dir_rec), get_dirtab_offset(fs) + (off_t)i * sizeof(struct dir_rec)) < 0)
         return -WRITE_ERR;
+
     return 0;
 }
 
-int free_all_under_from(int blockid, int start) {
-    int *blocks = malloc(h.block_size);
-    if (lseek(dev_id, get_blocks_offset() + blockid*h.block_size, SEEK_SET) < 0
-                || read(dev_id, blocks, h.block_size) < 0) {
-        free(blocks);
+//holes (-1) are not counted as errors
+int get_block_id(struct vsfs *fs, struct fstat *stat, int block_offset, int create) {
+    STATS_BEGIN(probe);
+    int id = map_block_id(fs, stat, block_offset, create);
+    STATS_END(fs, probe, VS_OP_GET_BLOCK_ID, 0, id < -1);
+    return id;
+}
+
+int map_block_id(struct vsfs *fs, struct fstat *stat, int block_offset, int create) {
+    if (block_offset < FILE_BLOCKS-1) {
+        int id = stat->blocks_map[block_offset];
+        if (id >= 0 || !create) {
+            return id;
+        } else {
+            int new_blockid = occupy_next_block(fs);
+            if (new_blockid < 0) return -EOF_ERR;
+            stat->blocks_map[block_offset] = new_blockid;
+            return new_blockid;
+        }
+    } else {
+        if (block_offset-FILE_BLOCKS+1 >= fs->h.block_size / (int)sizeof(int))
+            return -EOF_ERR;
+
+        struct buf *b;
+        if (stat->blocks_map[FILE_BLOCKS-1] < 0) {
+            if (!create)
+                return -EOF_ERR;
+
+            int new_blockid = occupy_next_block(fs);
+            if (new_blockid < 0) return -EOF_ERR;
+            stat->blocks_map[FILE_BLOCKS-1] = new_blockid;
+            if ((b = buf_get(fs, new_blockid, 0)) == NULL)
+                return -WRITE_ERR;
+            int *blocks = (int *)b->data;
+            for (int i = 0; i < fs->h.block_size/(int)sizeof(int); i++)
+                blocks[i] = -1;
+            b->dirty = 1;
+        } else if ((b = buf_get(fs, stat->blocks_map[FILE_BLOCKS-1], 1)) == NULL) {
+            return -READ_ERR;
+        }
+        b->meta = 1;
+
+        int *blocks = (int *)b->data;
+        int id = blocks[block_offset-FILE_BLOCKS+1];
+        if (id >= 0 || !create)
+            return id;
+
+        int new_blockid = occupy_next_block(fs);
+        if (new_blockid < 0) return -EOF_ERR;
+        blocks[block_offset-FILE_BLOCKS+1] = new_blockid;
+        b->dirty = 1;
+        return new_blockid;
+    }
+}
+
+int free_block(struct vsfs *fs, int blockid) {
+    if (blockid < 0) {
+        return 0;
+    }
+    if (blockid >= fs->h.nblocks)
         return -WRITE_ERR;
+
+    uint64_t bit = (uint64_t)1 << (blockid % 64);
+    pthread_mutex_lock(&fs->buf_lock);
+    buf_invalidate(fs, blockid);
+    pthread_mutex_unlock(&fs->buf_lock);
+
+    //freed block stays occupied until the transaction freeing it commits
+    if (fs->journal) {
+        if (!(fs->bitmap[blockid / 64] & bit))
+            return 0;
+        if (fs->jnfree == fs->jfree_cap) {
+            fs->jfree_cap = fs->jfree_cap ? 2 * fs->jfree_cap : 64;
+            fs->jfree = realloc(fs->jfree, fs->jfree_cap * sizeof(int));
+        }
+        fs->jfree[fs->jnfree++] = blockid;
+        return 0;
     }
-    for (int i = start; i < h.block_size/sizeof(int); i++) {
+
+    aio_drain(fs);
+    if (fs->bitmap[blockid / 64] & bit)
+        fs->bitmap_nfree++;
+    fs->bitmap[blockid / 64] &= ~bit;
+    mark_bitmap_dirty(fs, blockid);
+    return 0;
+}
+
+int free_all_under_from(struct vsfs *fs, int blockid, int start) {
+    struct buf *b = buf_get(fs, blockid, 1);
+    if (b == NULL)
+        return -WRITE_ERR;
+    b->meta = 1;
+
+    int *blocks = (int *)b->data;
+    for (int i = start; i < fs->h.block_size/(int)sizeof(int); i++) {
         int block_id = blocks[i];
         if (block_id < 0)
-            break;
+            continue;
         
         blocks[i] = -1;
-        if (free_block(block_id) < 0) {
-            free(blocks);
+        if (free_block(fs, block_id) < 0)
             return -WRITE_ERR;
+    }
+    b->dirty = 1;
+    return 0;
+}
+
+int load_bitmap(struct vsfs *fs) {
+    fs->bitmap_hint = 0;
+    fs->bitmap_dirty_lo = fs->h.nblocks;
+    fs->bitmap_dirty_hi = 0;
+    fs->bitmap_nwords = (fs->h.nblocks + 63) / 64;
+
+    //version 3 bitmap is the in-memory one, bits past the last block are set here.
+    //It is kept in whole pages of the image, so that flush_bitmap writes pages
+    if (fs->aligned) {
+        int size = ROUND_UP(fs->bitmap_nwords * sizeof(uint64_t), FORMAT_ALIGN);
+        if (posix_memalign((void **)&fs->bitmap, FORMAT_ALIGN, size) != 0) {
+            fs->bitmap = NULL;
+            return -READ_ERR;
+        }
+        if (dev_read(fs, fs->bitmap, size, fs->bitmap_offset) < size)
+            return -READ_ERR;
+        if (fs->h.nblocks % 64)
+            fs->bitmap[fs->bitmap_nwords - 1] |= ~(uint64_t)0 << (fs->h.nblocks % 64);
+        if (fs->clean) {
+            fs->bitmap_nfree = fs->clean_blocks_free;
+            return 0;
+        }
+        fs->bitmap_nfree = 0;
+        for (int w = 0; w < fs->bitmap_nwords; w++)
+            fs->bitmap_nfree += 64 - __builtin_popcountll(fs->bitmap[w]);
+        return 0;
+    }
+
+    off_t read_offset = fs->bitmap_offset;
+    char *blocks_bitmap = malloc(fs->h.nblocks * sizeof(char));
+    if (dev_read(fs, blocks_bitmap, fs->h.nblocks * sizeof(char), read_offset) < fs->h.nblocks) {
+        free(blocks_bitmap);
+        return -READ_ERR;
+    }
+
+    //bits past the last block are marked occupied so they are never handed out
+    fs->bitmap = malloc(fs->bitmap_nwords * sizeof(uint64_t));
+    for (int w = 0; w < fs->bitmap_nwords; w++)
+        fs->bitmap[w] = ~(uint64_t)0;
+
+    fs->bitmap_nfree = 0;
+    for (int i = 0; i < fs->h.nblocks; i++) {
+        if (!blocks_bitmap[i]) {
+            fs->bitmap[i / 64] &= ~((uint64_t)1 << (i % 64));
+            fs->bitmap_nfree++;
         }
     }
-    if (lseek(dev_id, get_blocks_offset() + blockid*h.block_size, SEEK_SET) < 0
-                || write(dev_id, blocks, h.block_size) < 0) {
-        free(blocks);
+    free(blocks_bitmap);
+    return 0;
+}
+
+void mark_bitmap_dirty(struct vsfs *fs, int i) {
+    if (i < fs->bitmap_dirty_lo) fs->bitmap_dirty_lo = i;
+    if (i + 1 > fs->bitmap_dirty_hi) fs->bitmap_dirty_hi = i + 1;
+}
+
+int flush_bitmap(struct vsfs *fs) {
+    if (fs->bitmap_dirty_lo >= fs->bitmap_dirty_hi)
+        return 0;
+
+    //version 3 bitmap is written a page at a time
+    if (fs->aligned) {
+        int words = FORMAT_ALIGN / sizeof(uint64_t);
+        int lo = fs->bitmap_dirty_lo / 64 / words * words;
+        int hi = ROUND_UP((fs->bitmap_dirty_hi + 63) / 64, words);
+        if (meta_write(fs, &fs->bitmap[lo], (hi - lo) * sizeof(uint64_t),
+                       fs->bitmap_offset + (off_t)lo * sizeof(uint64_t)) < 0)
+            return -WRITE_ERR;
+        fs->bitmap_dirty_lo = fs->h.nblocks;
+        fs->bitmap_dirty_hi = 0;
+        return 0;
+    }
+
+    int len = fs->bitmap_dirty_hi - fs->bitmap_dirty_lo;
+    char *blocks_bitmap = malloc(len * sizeof(char));
+    for (int i = 0; i < len; i++) {
+        int blockid = fs->bitmap_dirty_lo + i;
+        blocks_bitmap[i] = (fs->bitmap[blockid / 64] >> (blockid % 64)) & 1;
+    }
+
+    off_t write_offset = fs->bitmap_offset + fs->bitmap_dirty_lo * sizeof(char);
+    if (meta_write(fs, blocks_bitmap, len, write_offset) < 0) {
+        free(blocks_bitmap);
         return -WRITE_ERR;
     }
-    free(blocks);
+    free(blocks_bitmap);
+
+    fs->bitmap_dirty_lo = fs->h.nblocks;
+    fs->bitmap_dirty_hi = 0;
     return 0;
 }
+
+int load_dirtab(struct vsfs *fs) {
+    fs->dirtab = malloc(sizeof(struct dir_rec) * (fs->h.nfiles_max + 1));
+    if (read_dirtab(fs, fs->dirtab) < 0) {
+        return -READ_ERR;
+    }
+
+    //index is kept at most half full
+    int index_size = 1;
+    while (index_size < 2 * fs->h.nfiles_max)
+        index_size <<= 1;
+    fs->dir_index_mask = index_size - 1;
+    fs->dir_index = malloc(index_size * sizeof(int));
+    for (int i = 0; i < index_size; i++)
+        fs->dir_index[i] = -1;
+
+    fs->dir_dirty_lo = fs->h.nfiles_max;
+    fs->dir_dirty_hi = 0;
+
+    //free slots are pushed from the end so that the lowest one is taken first
+    fs->dir_free = malloc(fs->h.nfiles_max * sizeof(int));
+    fs->dir_nfree = 0;
+    for (int i = fs->h.nfiles_max - 1; i >= 0; i--) {
+        //record without a name is an unused one left zero by VS_MKFS_LAZY,
+        //create_file and link_file refuse empty names
+        if (fs->dirtab[i].name[0] == 0)
+            fs->dirtab[i].id = -1;
+
+        if (fs->dirtab[i].id >= 0)
+            dir_index_insert(fs, i);
+        else
+            fs->dir_free[fs->dir_nfree++] = i;
+    }
+    return 0;
+}
+
+//ids are pushed from the end so that the lowest one is taken first
+int load_free_inodes(struct vsfs *fs) {
+    fs->ino_free = malloc(fs->h.nfiles_max * sizeof(int));
+    fs->ino_nfree = 0;
+
+    //every inode in use on a cleanly unmounted image has directory records,
+    //so the directory table tells them apart without reading the inode table
+    if (fs->clean) {
+        char *used = calloc(fs->h.nfiles_max, 1);
+        for (int i = 0; i < fs->h.nfiles_max; i++) {
+            int id = fs->dirtab[i].id;
+            if (id >= 0 && id < fs->h.nfiles_max)
+                used[id] = 1;
+        }
+        for (int id = fs->h.nfiles_max - 1; id >= 0; id--) {
+            if (!used[id])
+                fs->ino_free[fs->ino_nfree++] = id;
+        }
+        free(used);
+        if (fs->ino_nfree == fs->clean_files_free)
+            return 0;
+        fs->ino_nfree = 0;
+    }
+
+    struct fstat *fstattab = malloc(sizeof(struct fstat) * fs->h.nfiles_max);
+    if (read_fstattab(fs, fstattab) < 0) {
+        free(fstattab);
+        return -READ_ERR;
+    }
+
+    for (int id = fs->h.nfiles_max - 1; id >= 0; id--) {
+        if (fstattab[id].nlinks <= 0)
+            fs->ino_free[fs->ino_nfree++] = id;
+    }
+    free(fstattab);
+    return 0;
+}
+
+//FNV-1a over at most MAX_NAMESIZE characters of the name
+unsigned int dir_hash(char *name) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < MAX_NAMESIZE && name[i]; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int dir_lookup(struct vsfs *fs, char *name) {
+    for (unsigned int i = dir_hash(name) & fs->dir_index_mask;
+            fs->dir_index[i] != -1; i = (i + 1) & fs->dir_index_mask) {
+        int slot = fs->dir_index[i];
+        if (0 == strncmp(fs->dirtab[slot].name, name, MAX_NAMESIZE))
+            return slot;
+    }
+    return -1;
+}
+
+void dir_index_insert(struct vsfs *fs, int slot) {
+    unsigned int i = dir_hash(fs->dirtab[slot].name) & fs->dir_index_mask;
+    while (fs->dir_index[i] != -1)
+        i = (i + 1) & fs->dir_index_mask;
+    fs->dir_index[i] = slot;
+}
+
+void dir_index_remove(struct vsfs *fs, int slot) {
+    unsigned int i = dir_hash(fs->dirtab[slot].name) & fs->dir_index_mask;
+    while (fs->dir_index[i] != slot)
+        i = (i + 1) & fs->dir_index_mask;
+
+    //shift back following entries of the probe chain instead of leaving a tombstone
+    unsigned int j = i;
+    while (1) {
+        j = (j + 1) & fs->dir_index_mask;
+        if (fs->dir_index[j] == -1)
+            break;
+        unsigned int k = dir_hash(fs->dirtab[fs->dir_index[j]].name) & fs->dir_index_mask;
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            fs->dir_index[i] = fs->dir_index[j];
+            i = j;
+        }
+    }
+    fs->dir_index[i] = -1;
+}
+
+int dir_alloc_slot(struct vsfs *fs) {
+    if (fs->dir_nfree == 0) return -1;
+    return fs->dir_free[--fs->dir_nfree];
+}
+
+void dir_release_slot(struct vsfs *fs, int slot) {
+    fs->dir_free[fs->dir_nfree++] = slot;
+}
+
+struct inode *inode_find(struct vsfs *fs, int id) {
+    struct inode *ino = fs->inode_buckets[id % MAX_FILES_OPENED];
+    while (ino != NULL && ino->id != id)
+        ino = ino->next;
+    return ino;
+}
+
+//new cache entry of inode id, not linked into the cache yet
+struct inode *inode_alloc(int id, struct fstat *stat) {
+    struct inode *ino = malloc(sizeof(struct inode));
+    ino->stat = *stat;
+    ino->id = id;
+    ino->nopen = 0;
+    ino->dirty = 0;
+    ino->ext = NULL;
+    ino->next_ext = 0;
+    ino->ext_cap = 0;
+    ino->ext_dirty = 0;
+    ino->chain = NULL;
+    ino->nchain = 0;
+    ino->ext_hint = 0;
+    ino->da_buf = NULL;
+    ino->da_block = 0;
+    ino->da_len = 0;
+    ino->da_nres = 0;
+    pthread_rwlock_init(&ino->lock, NULL);
+    return ino;
+}
+
+void inode_insert(struct vsfs *fs, struct inode *ino) {
+    ino->next = fs->inode_buckets[ino->id % MAX_FILES_OPENED];
+    fs->inode_buckets[ino->id % MAX_FILES_OPENED] = ino;
+}
+
+//returns cached inode, reading it from the image if it is not cached yet
+struct inode *inode_get(struct vsfs *fs, int id) {
+    struct inode *ino = inode_find(fs, id);
+    if (ino != NULL)
+        return ino;
+
+    struct fstat stat;
+    if (read_stat(fs, id, &stat) < 0)
+        return NULL;
+
+    ino = inode_alloc(id, &stat);
+    if (fs->version == FORMAT_EXTENTS && load_extents(fs, ino) < 0) {
+        pthread_rwlock_destroy(&ino->lock);
+        free(ino->ext);
+        free(ino->chain);
+        free(ino);
+        return NULL;
+    }
+    inode_insert(fs, ino);
+    return ino;
+}
+
+//inode not referenced by any descriptor is written back and dropped,
+//during a batch inodes are kept till vs_batch_commit. A file unlinked while
+//open keeps its blocks until here, as descriptors still read and write them
+int inode_put(struct vsfs *fs, struct inode *ino) {
+    if (ino->nopen > 0 || fs->batch)
+        return 0;
+
+    int err = 0;
+    if (ino->stat.nlinks <= 0 && ino->stat.ftype != -1) {
+        ino->stat.ftype = -1;
+        ino->stat.size = 0;
+        da_trim(fs, ino, 0);
+        if (bmap_truncate(fs, ino, 0) < 0)
+            err = -WRITE_ERR;
+        ino->dirty = 1;
+    }
+    if (ino->ext_dirty && store_extents(fs, ino) < 0)
+        err = -WRITE_ERR;
+    if (ino->dirty && write_fstat(fs, &ino->stat, ino->id) < 0)
+        err = -WRITE_ERR;
+
+    struct inode **p = &fs->inode_buckets[ino->id % MAX_FILES_OPENED];
+    while (*p != ino)
+        p = &(*p)->next;
+    *p = ino->next;
+
+    //file with no links left is gone with its last reference
+    if (ino->stat.nlinks <= 0)
+        fs->ino_free[fs->ino_nfree++] = ino->id;
+    pthread_rwlock_destroy(&ino->lock);
+    free(ino->ext);
+    free(ino->chain);
+    free(ino);
+    return err;
+}
+
+int inode_cmp(const void *a, const void *b) {
+    return (*(struct inode **)a)->id - (*(struct inode **)b)->id;
+}
+
+//dirty inodes are written in order of id, those with consecutive ids with a single call
+int flush_inodes(struct vsfs *fs) {
+    struct inode **dirty = NULL;
+    int ndirty = 0;
+    int cap = 0;
+    for (int i = 0; i < MAX_FILES_OPENED; i++) {
+        for (struct inode *ino = fs->inode_buckets[i]; ino != NULL; ino = ino->next) {
+            if (da_flush(fs, ino) < 0 || (ino->ext_dirty && store_extents(fs, ino) < 0)) {
+                free(dirty);
+                return -WRITE_ERR;
+            }
+            if (!ino->dirty) continue;
+            if (ndirty == cap) {
+                cap = cap ? 2 * cap : 64;
+                dirty = realloc(dirty, cap * sizeof(struct inode *));
+            }
+            dirty[ndirty++] = ino;
+        }
+    }
+    if (ndirty == 0)
+        return 0;
+    qsort(dirty, ndirty, sizeof(struct inode *), inode_cmp);
+
+    struct fstat *stats = malloc(ndirty * sizeof(struct fstat));
+    for (int i = 0, j; i < ndirty; i = j) {
+        for (j = i + 1; j < ndirty && dirty[j]->id == dirty[j - 1]->id + 1; j++)
+            ;
+        for (int k = i; k < j; k++)
+            stats[k - i] = dirty[k]->stat;
+
+        //a run of inodes is one write of VS_OP_WRITE_FSTAT
+        STATS_BEGIN(probe);
+        off_t write_offset = get_fstattab_offset(fs) + (off_t)dirty[i]->id * sizeof(struct fstat);
+        int err = meta_write(fs, stats, (j - i) * sizeof(struct fstat), write_offset);
+        STATS_END(fs, probe, VS_OP_WRITE_FSTAT, err < 0 ? 0 : (j - i) * sizeof(struct fstat), err < 0);
+        if (err < 0) {
+            free(stats);
+            free(dirty);
+            return -WRITE_ERR;
+        }
+        for (int k = i; k < j; k++)
+            dirty[k]->dirty = 0;
+    }
+    free(stats);
+    free(dirty);
+    return 0;
+}
+
+//writes back directory records changed during a batch
+int flush_dirtab(struct vsfs *fs) {
+    if (fs->dir_dirty_lo >= fs->dir_dirty_hi)
+        return 0;
+
+    int len = (fs->dir_dirty_hi - fs->dir_dirty_lo) * sizeof(struct dir_rec);
+    off_t write_offset = get_dirtab_offset(fs) + (off_t)fs->dir_dirty_lo * sizeof(struct dir_rec);
+    if (meta_write(fs, fs->dirtab + fs->dir_dirty_lo, len, write_offset) < 0)
+        return -WRITE_ERR;
+
+    fs->dir_dirty_lo = fs->h.nfiles_max;
+    fs->dir_dirty_hi = 0;
+    return 0;
+}
+
+//image access goes either through the mapping or through pread/pwrite
+int dev_read(struct vsfs *fs, void *buf, int size, off_t offset) {
+    int n;
+    if (fs->dev_map != NULL) {
+        if (offset < 0 || offset >= fs->dev_map_size)
+            return 0;
+        if (size > fs->dev_map_size - offset)
+            size = fs->dev_map_size - offset;
+        memcpy(buf, fs->dev_map + offset, size);
+        n = size;
+    } else if (dev_unaligned(fs, buf, size, offset)) {
+        n = dev_bounce_read(fs, buf, size, offset);
+    } else {
+        STATS_SYSCALL();
+        n = pread(fs->dev_id, buf, size, offset);
+    }
+
+    if (fs->overlay != NULL && n > 0)
+        overlay_recs(fs->overlay, fs->overlay_len, buf, n, offset);
+    return n;
+}
+
+int dev_write(struct vsfs *fs, void *buf, int size, off_t offset) {
+    if (fs->dev_map != NULL) {
+        if (offset < 0 || offset > fs->dev_map_size - size)
+            return -1;
+        memcpy(fs->dev_map + offset, buf, size);
+        return size;
+    }
+    if (dev_unaligned(fs, buf, size, offset))
+        return dev_bounce_write(fs, buf, size, offset);
+
+    STATS_SYSCALL();
+    return pwrite(fs->dev_id, buf, size, offset);
+}
+
+/*
+  Metadata of version 3 images (everything but the data area) is read and
+  written in whole FORMAT_ALIGN pages from FORMAT_ALIGN aligned memory, as
+  O_DIRECT requires. Other accesses go through a bounce buffer covering the
+  pages, and the pages a write covers only partly are read first, under
+  dev_lock so that two writes into one page don't undo each other. Until
+  layout_regions runs the whole image counts as metadata.
+*/
+int dev_unaligned(struct vsfs *fs, void *buf, int size, off_t offset) {
+    if (!fs->aligned || (offset >= fs->blocks_offset && offset < fs->jstart))
+        return 0;
+    return offset % FORMAT_ALIGN != 0 || size % FORMAT_ALIGN != 0
+        || (uintptr_t)buf % FORMAT_ALIGN != 0;
+}
+
+int dev_bounce_read(struct vsfs *fs, void *buf, int size, off_t offset) {
+    off_t start = offset / FORMAT_ALIGN * FORMAT_ALIGN;
+    size_t len = ROUND_UP(offset + size, FORMAT_ALIGN) - start;
+    char *pages;
+    if (posix_memalign((void **)&pages, FORMAT_ALIGN, len) != 0)
+        return -1;
+
+    STATS_SYSCALL();
+    ssize_t n = pread(fs->dev_id, pages, len, start);
+    if (n >= 0) {
+        n = n > offset - start ? n - (offset - start) : 0;
+        if (n > size)
+            n = size;
+        memcpy(buf, pages + (offset - start), n);
+    }
+    free(pages);
+    return n;
+}
+
+int dev_bounce_write(struct vsfs *fs, void *buf, int size, off_t offset) {
+    off_t start = offset / FORMAT_ALIGN * FORMAT_ALIGN;
+    off_t end = ROUND_UP(offset + size, FORMAT_ALIGN);
+    size_t len = end - start;
+    char *pages;
+    if (posix_memalign((void **)&pages, FORMAT_ALIGN, len) != 0)
+        return -1;
+
+    //pages past the end of the image read as zeros
+    pthread_mutex_lock(&fs->dev_lock);
+    int err = 0;
+    if (offset > start) {
+        memset(pages, 0, FORMAT_ALIGN);
+        STATS_SYSCALL();
+        err |= pread(fs->dev_id, pages, FORMAT_ALIGN, start) < 0;
+    }
+    if (offset + size < end && (end - FORMAT_ALIGN > start || offset == start)) {
+        memset(pages + len - FORMAT_ALIGN, 0, FORMAT_ALIGN);
+        STATS_SYSCALL();
+        err |= pread(fs->dev_id, pages + len - FORMAT_ALIGN, FORMAT_ALIGN, end - FORMAT_ALIGN) < 0;
+    }
+    memcpy(pages + (offset - start), buf, size);
+
+    ssize_t n = -1;
+    if (!err) {
+        STATS_SYSCALL();
+        n = pwrite(fs->dev_id, pages, len, start);
+    }
+    pthread_mutex_unlock(&fs->dev_lock);
+    free(pages);
+    if (n < 0)
+        return -1;
+    n -= offset - start;
+    return n < 0 ? 0 : n > size ? size : n;
+}
+
+//tells the kernel a range of the image is going to be read soon
+void dev_advise(struct vsfs *fs, off_t offset, off_t len) {
+    if (fs->dev_map != NULL) {
+        off_t start = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        if (offset + len > fs->dev_map_size)
+            len = fs->dev_map_size - offset;
+        if (len > 0) {
+            STATS_SYSCALL();
+            madvise(fs->dev_map + start, offset + len - start, MADV_WILLNEED);
+        }
+        return;
+    }
+
+    STATS_SYSCALL();
+    posix_fadvise(fs->dev_id, offset, len, POSIX_FADV_WILLNEED);
+}
+
+//makes everything written to the image so far durable
+int dev_sync(struct vsfs *fs) {
+    STATS_SYSCALL();
+    if (fs->dev_map != NULL)
+        return msync(fs->dev_map, fs->dev_map_size, MS_SYNC);
+
+    return fsync(fs->dev_id);
+}
+
+//reads metadata as it is in the open transaction of the journal
+int meta_read(struct vsfs *fs, void *buf, int size, off_t offset) {
+    int n = dev_read(fs, buf, size, offset);
+    if (n < 0 || !fs->journal)
+        return n;
+
+    pthread_mutex_lock(&fs->jlock);
+    overlay_recs(fs->jbuf + sizeof(struct journal_txn), fs->jlen, buf, n, offset);
+    pthread_mutex_unlock(&fs->jlock);
+    return n;
+}
+
+//copies what journal records recs, len bytes of them, write into the n bytes
+//at offset that buf holds, later records over earlier ones
+void overlay_recs(char *recs, int len, void *buf, int n, off_t offset) {
+    for (int pos = 0; pos < len; ) {
+        struct journal_rec *r = (struct journal_rec *)(recs + pos);
+        pos += sizeof(struct journal_rec) + ((r->len + 7) & ~7);
+        if (r->offset == JREC_REVOKE
+                || r->offset >= offset + n || r->offset + r->len <= offset)
+            continue;
+
+        off_t lo = r->offset > offset ? r->offset : offset;
+        off_t hi = r->offset + r->len < offset + n ? r->offset + r->len : offset + n;
+        memcpy((char *)buf + (lo - offset), (char *)(r + 1) + (lo - r->offset), hi - lo);
+    }
+}
+
+int meta_write(struct vsfs *fs, void *buf, int size, off_t offset) {
+    if (fs->journal)
+        return journal_log(fs, offset, buf, size) < 0 ? -1 : size;
+
+    return dev_write(fs, buf, size, offset);
+}
+
+int buf_init(struct vsfs *fs, int nframes) {
+    int hash_size = 1;
+    while (hash_size < nframes)
+        hash_size <<= 1;
+
+    struct buf *bufs = calloc(nframes, sizeof(struct buf));
+    struct buf **hash = calloc(hash_size, sizeof(struct buf *));
+    //frames are page aligned, indirect and extent blocks are written from them
+    char *data;
+    if (posix_memalign((void **)&data, FORMAT_ALIGN, (size_t)nframes * fs->h.block_size) != 0)
+        data = NULL;
+    if (bufs == NULL || hash == NULL || data == NULL) {
+        free(bufs);
+        free(hash);
+        free(data);
+        return -1;
+    }
+
+    for (int i = 0; i < nframes; i++) {
+        bufs[i].blockid = -1;
+        bufs[i].data = data + (size_t)i * fs->h.block_size;
+    }
+    fs->bufs = bufs;
+    fs->nbufs = nframes;
+    fs->buf_hand = 0;
+    fs->buf_hash = hash;
+    fs->buf_hash_mask = hash_size - 1;
+    return 0;
+}
+
+//frees frames without writing them back
+void buf_free(struct vsfs *fs) {
+    if (fs->bufs != NULL)
+        free(fs->bufs[0].data);
+    free(fs->bufs);
+    free(fs->buf_hash);
+    fs->bufs = NULL;
+    fs->buf_hash = NULL;
+    fs->nbufs = 0;
+}
+
+struct buf *buf_find(struct vsfs *fs, int blockid) {
+    struct buf *b = fs->buf_hash[blockid & fs->buf_hash_mask];
+    while (b != NULL && b->blockid != blockid)
+        b = b->next;
+    return b;
+}
+
+/*
+  Returns frame of blockid, taking one with buf_victim if the block is not
+  cached. New frame is filled from the image when load is set, otherwise
+  its contents are undefined and the caller overwrites the whole block.
+  Frame stays valid until the next call taking a frame.
+*/
+struct buf *buf_get(struct vsfs *fs, int blockid, int load) {
+    struct buf *b = buf_find(fs, blockid);
+    if (b != NULL) {
+        fs->cache_stats.hits++;
+        b->ref = 1;
+        return b;
+    }
+    fs->cache_stats.misses++;
+
+    if ((b = buf_victim(fs)) == NULL)
+        return NULL;
+
+    if (load) {
+        off_t read_offset = get_blocks_offset(fs) + (off_t)blockid * fs->h.block_size;
+        if (meta_read(fs, b->data, fs->h.block_size, read_offset) < fs->h.block_size)
+            return NULL;
+    }
+    buf_insert(fs, b, blockid);
+    return b;
+}
+
+//CLOCK replacement, returns an unused frame writing back and evicting its block if needed
+struct buf *buf_victim(struct vsfs *fs) {
+    while (1) {
+        struct buf *b = &fs->bufs[fs->buf_hand];
+        fs->buf_hand = (fs->buf_hand + 1) % fs->nbufs;
+
+        if (b->blockid < 0)
+            return b;
+        if (b->ref) {
+            b->ref = 0;
+            continue;
+        }
+        if (b->dirty && buf_writeback(fs, b) < 0)
+            return NULL;
+        buf_invalidate(fs, b->blockid);
+        fs->cache_stats.evictions++;
+        return b;
+    }
+}
+
+void buf_insert(struct vsfs *fs, struct buf *b, int blockid) {
+    struct buf **bucket = &fs->buf_hash[blockid & fs->buf_hash_mask];
+    b->blockid = blockid;
+    b->ref = 1;
+    b->dirty = 0;
+    b->meta = 0;
+    b->next = *bucket;
+    *bucket = b;
+}
+
+//drops cached copy of the block, dirty contents are discarded
+void buf_invalidate(struct vsfs *fs, int blockid) {
+    struct buf **p = &fs->buf_hash[blockid & fs->buf_hash_mask];
+    while (*p != NULL && (*p)->blockid != blockid)
+        p = &(*p)->next;
+    if (*p == NULL)
+        return;
+
+    struct buf *b = *p;
+    *p = b->next;
+    b->blockid = -1;
+    b->ref = 0;
+    b->dirty = 0;
+    b->meta = 0;
+}
+
+/*
+  Writes dirty frame back in one call together with dirty frames of the
+  blocks around it. Indirect and extent blocks go through meta_write and
+  are only clustered with each other.
+*/
+int buf_writeback(struct vsfs *fs, struct buf *b) {
+    int bs = fs->h.block_size;
+    int first = b->blockid;
+    int last = b->blockid;
+    struct buf *n;
+    while (first > 0 && (n = buf_find(fs, first - 1)) != NULL && n->dirty && n->meta == b->meta)
+        first--;
+    while (last + 1 < fs->h.nblocks && (n = buf_find(fs, last + 1)) != NULL && n->dirty && n->meta == b->meta)
+        last++;
+
+    int (*write)(struct vsfs *, void *, int, off_t) = b->meta ? meta_write : dev_write;
+    int len = (last - first + 1) * bs;
+    off_t write_offset = get_blocks_offset(fs) + (off_t)first * bs;
+    if (first == last) {
+        if (write(fs, b->data, bs, write_offset) < bs)
+            return -WRITE_ERR;
+    } else {
+        char *data;
+        if (posix_memalign((void **)&data, FORMAT_ALIGN, len) != 0)
+            return -WRITE_ERR;
+        for (int i = first; i <= last; i++)
+            memcpy(data + (i - first) * bs, buf_find(fs, i)->data, bs);
+        if (write(fs, data, len, write_offset) < len) {
+            free(data);
+            return -WRITE_ERR;
+        }
+        free(data);
+    }
+
+    for (int i = first; i <= last; i++)
+        buf_find(fs, i)->dirty = 0;
+    fs->cache_stats.writebacks += last - first + 1;
+    return 0;
+}
+
+int buf_flush(struct vsfs *fs) {
+    for (int i = 0; i < fs->nbufs; i++) {
+        struct buf *b = &fs->bufs[i];
+        if (b->blockid >= 0 && b->dirty && buf_writeback(fs, b) < 0)
+            return -WRITE_ERR;
+    }
+    return 0;
+}
+
+int buf_flush_range(struct vsfs *fs, int blockid, int nblocks) {
+    for (int i = blockid; i < blockid + nblocks; i++) {
+        struct buf *b = buf_find(fs, i);
+        if (b != NULL && b->dirty && buf_writeback(fs, b) < 0)
+            return -WRITE_ERR;
+    }
+    return 0;
+}
+
+/*
+  Reads len bytes starting at byte_offset of block blockid, the data lies in
+  nblocks physically contiguous blocks. Blocks missing in the cache are read
+  with one call per uncached stretch and cached. Runs longer than half of
+  the cache are read directly, so that one big read does not flush it.
+  Image reads are done without buf_lock, so readers only wait for each
+  other on cache hits. With dst NULL the blocks are only brought into the
+  cache (readahead). The mapping of VS_MOUNT_MMAP mounts is the page cache
+  already, so data is copied straight from it and never takes frames; only
+  indirect and extent blocks are cached then (buf_get).
+*/
+int buf_read(struct vsfs *fs, int blockid, int nblocks, int byte_offset, int len, char *dst) {
+    int bs = fs->h.block_size;
+
+    if (fs->dev_map != NULL) {
+        off_t read_offset = get_blocks_offset(fs) + (off_t)blockid * bs + byte_offset;
+        if (dst == NULL) {
+            dev_advise(fs, read_offset, len);
+            return len;
+        }
+        return dev_read(fs, dst, len, read_offset);
+    }
+
+    pthread_mutex_lock(&fs->buf_lock);
+    if (nblocks > fs->nbufs / 2 && dst != NULL) {
+        int err = buf_flush_range(fs, blockid, nblocks);
+        pthread_mutex_unlock(&fs->buf_lock);
+        if (err < 0)
+            return -READ_ERR;
+        return dev_read(fs, dst, len, get_blocks_offset(fs) + (off_t)blockid * bs + byte_offset);
+    }
+
+    int done = 0;
+    int i = 0;
+    while (i < nblocks && done < len) {
+        int skip = i == 0 ? byte_offset : 0;
+        struct buf *b = buf_find(fs, blockid + i);
+        if (b != NULL) {
+            fs->cache_stats.hits++;
+            b->ref = 1;
+            int n = bs - skip < len - done ? bs - skip : len - done;
+            if (dst != NULL)
+                memcpy(dst + done, b->data + skip, n);
+            done += n;
+            i++;
+            continue;
+        }
+
+        int j = i + 1;
+        while (j < nblocks && buf_find(fs, blockid + j) == NULL)
+            j++;
+
+        int size = (j - i) * bs;
+        char *data = malloc(size);
+        pthread_mutex_unlock(&fs->buf_lock);
+        int rsize = dev_read(fs, data, size, get_blocks_offset(fs) + (off_t)(blockid + i) * bs);
+        pthread_mutex_lock(&fs->buf_lock);
+        if (rsize < 0) {
+            pthread_mutex_unlock(&fs->buf_lock);
+            free(data);
+            return -READ_ERR;
+        }
+
+        //a concurrent reader of the same blocks may have cached them meanwhile
+        for (int k = i; k < j && (k - i + 1) * bs <= rsize; k++) {
+            fs->cache_stats.misses++;
+            if (buf_find(fs, blockid + k) != NULL)
+                continue;
+            if ((b = buf_victim(fs)) == NULL) {
+                pthread_mutex_unlock(&fs->buf_lock);
+                free(data);
+                return -READ_ERR;
+            }
+            memcpy(b->data, data + (k - i) * bs, bs);
+            buf_insert(fs, b, blockid + k);
+        }
+
+        int n = rsize - skip < len - done ? rsize - skip : len - done;
+        if (n > 0) {
+            if (dst != NULL)
+                memcpy(dst + done, data + skip, n);
+            done += n;
+        }
+        free(data);
+        if (rsize < size)
+            break;
+        i = j;
+    }
+    pthread_mutex_unlock(&fs->buf_lock);
+    return done;
+}
+
+/*
+  Counterpart of buf_read, written blocks stay dirty in the cache. When the
+  blocks are fresh (just allocated) parts of them not covered by the write
+  are zeroed instead of being read from the image. Mapped images are
+  written in place, like buf_read reads them.
+*/
+int buf_write(struct vsfs *fs, int blockid, int nblocks, int byte_offset, int len, char *src, int fresh) {
+    int bs = fs->h.block_size;
+
+    if (fs->dev_map != NULL) {
+        off_t write_offset = get_blocks_offset(fs) + (off_t)blockid * bs;
+        int end = byte_offset + len;
+        int size = (end + bs - 1) / bs * bs;
+        if (write_offset < 0 || write_offset > fs->dev_map_size - size)
+            return -WRITE_ERR;
+        if (fresh) {
+            memset(fs->dev_map + write_offset, 0, byte_offset);
+            memset(fs->dev_map + write_offset + end, 0, size - end);
+        }
+        return dev_write(fs, src, len, write_offset + byte_offset);
+    }
+
+    pthread_mutex_lock(&fs->buf_lock);
+    if (nblocks > fs->nbufs / 2) {
+        if (buf_flush_range(fs, blockid, nblocks) < 0) {
+            pthread_mutex_unlock(&fs->buf_lock);
+            return -WRITE_ERR;
+        }
+
+        int wsize;
+        off_t write_offset = get_blocks_offset(fs) + (off_t)blockid * bs;
+        if (fresh && (byte_offset > 0 || (byte_offset + len) % bs > 0)) {
+            int size = (byte_offset + len + bs - 1) / bs * bs;
+            char *data = calloc(size, 1);
+            memcpy(data + byte_offset, src, len);
+            wsize = dev_write(fs, data, size, write_offset);
+            free(data);
+            if (wsize >= 0)
+                wsize = wsize - byte_offset < len ? wsize - byte_offset : len;
+        } else {
+            wsize = dev_write(fs, src, len, write_offset + byte_offset);
+        }
+        for (int i = blockid; i < blockid + nblocks; i++)
+            buf_invalidate(fs, i);
+        pthread_mutex_unlock(&fs->buf_lock);
+        return wsize;
+    }
+
+    int done = 0;
+    for (int i = 0; i < nblocks && done < len; i++) {
+        int skip = i == 0 ? byte_offset : 0;
+        int n = bs - skip < len - done ? bs - skip : len - done;
+
+        //partially written blocks are read first
+        struct buf *b = buf_get(fs, blockid + i, n < bs && !fresh);
+        if (b == NULL) {
+            pthread_mutex_unlock(&fs->buf_lock);
+            return -WRITE_ERR;
+        }
+        if (fresh && n < bs)
+            memset(b->data, 0, bs);
+        memcpy(b->data + skip, src + done, n);
+        b->dirty = 1;
+        done += n;
+    }
+    pthread_mutex_unlock(&fs->buf_lock);
+    return done;
+}
+
+//physical block of logical block lblock or -1 if it is a hole, *run is set to the
+//number of following blocks (up to max) mapped contiguously or not mapped at all
+int bmap_lookup(struct vsfs *fs, struct inode *ino, int lblock, int max, int *run) {
+    *run = 1;
+    if (fs->version == FORMAT_BLOCKMAP) {
+        //indirect block is read through the buffer cache
+        pthread_mutex_lock(&fs->buf_lock);
+        int blockid = get_block_id(fs, &ino->stat, lblock, 0);
+        if (blockid < 0) {
+            while (*run < max && get_block_id(fs, &ino->stat, lblock + *run, 0) < 0)
+                (*run)++;
+            blockid = -1;
+        } else {
+            while (*run < max && get_block_id(fs, &ino->stat, lblock + *run, 0) == blockid + *run)
+                (*run)++;
+        }
+        pthread_mutex_unlock(&fs->buf_lock);
+        return blockid;
+    }
+
+    //files are mostly read forward, so the search starts from the last extent found
+    uint64_t hint = __atomic_load_n(&ino->ext_hint, __ATOMIC_RELAXED);
+    int i = hint >> 32;
+    int l = (uint32_t)hint;
+    if (i >= ino->next_ext || lblock < l) {
+        i = 0;
+        l = 0;
+    }
+    for (; i < ino->next_ext; i++) {
+        struct extent *e = &ino->ext[i];
+        if (lblock < l + e->len) {
+            __atomic_store_n(&ino->ext_hint, (uint64_t)i << 32 | (uint32_t)l, __ATOMIC_RELAXED);
+            int off = lblock - l;
+            *run = e->len - off < max ? e->len - off : max;
+            return e->start < 0 ? -1 : e->start + off;
+        }
+        l += e->len;
+    }
+    *run = max;
+    return -1;
+}
+
+//like bmap_lookup, but missing blocks are allocated, trying to get want of them contiguously
+int bmap_alloc(struct vsfs *fs, struct inode *ino, int lblock, int want, int *run) {
+    if (fs->version == FORMAT_BLOCKMAP) {
+        pthread_mutex_lock(&fs->buf_lock);
+        int blockid = get_block_id(fs, &ino->stat, lblock, 1);
+        //the run is grown only while the block right after it is free and no indirect
+        //block has to be taken, so that no block past the returned run gets mapped
+        *run = 1;
+        while (blockid >= 0 && *run < want && blockid + *run < fs->h.nblocks
+                && free_run_length(fs, blockid + *run, 1) == 1
+                && (lblock + *run != FILE_BLOCKS-1 || ino->stat.blocks_map[FILE_BLOCKS-1] >= 0)
+                && get_block_id(fs, &ino->stat, lblock + *run, 1) == blockid + *run)
+            (*run)++;
+        pthread_mutex_unlock(&fs->buf_lock);
+        return blockid;
+    }
+
+    int blockid = bmap_lookup(fs, ino, lblock, want, run);
+    if (blockid >= 0)
+        return blockid;
+
+    //the run right after the closest mapped extent before lblock is preferred
+    int goal = -1;
+    int end = 0;
+    for (int i = 0; i < ino->next_ext; i++) {
+        struct extent *e = &ino->ext[i];
+        if (end < lblock && e->start >= 0)
+            goal = e->start + e->len;
+        end += e->len;
+    }
+
+    //*run is the length of the hole at lblock here
+    int got;
+    int start = alloc_run(fs, *run, goal, &got);
+    if (start < 0)
+        return -EOF_ERR;
+
+    if (lblock >= end) {
+        if ((lblock > end && ext_append(ino, -1, lblock - end) < 0)
+                || ext_append(ino, start, got) < 0)
+            return -EOF_ERR;
+    } else if (ext_fill(ino, lblock, start, got) < 0) {
+        return -EOF_ERR;
+    }
+
+    ino->ext_dirty = 1;
+    *run = got;
+    return start;
+}
+
+//frees all blocks of the file starting from logical block nblocks
+int bmap_truncate(struct vsfs *fs, struct inode *ino, int nblocks) {
+    if (fs->version == FORMAT_BLOCKMAP) {
+        struct fstat *stat = &ino->stat;
+        for (int i = nblocks; i < FILE_BLOCKS-1; i++) {
+            free_block(fs, stat->blocks_map[i]);
+            stat->blocks_map[i] = -1;
+        }
+        if (stat->blocks_map[FILE_BLOCKS-1] >= 0) {
+            int start = nblocks > FILE_BLOCKS-1 ? nblocks - (FILE_BLOCKS-1) : 0;
+            if (free_all_under_from(fs, stat->blocks_map[FILE_BLOCKS-1], start) < 0)
+                return -WRITE_ERR;
+            if (start == 0) {
+                free_block(fs, stat->blocks_map[FILE_BLOCKS-1]);
+                stat->blocks_map[FILE_BLOCKS-1] = -1;
+            }
+        }
+        ino->dirty = 1;
+        return 0;
+    }
+
+    int l = 0;
+    int i;
+    for (i = 0; i < ino->next_ext; i++) {
+        struct extent *e = &ino->ext[i];
+        if (nblocks < l + e->len) {
+            int keep = nblocks > l ? nblocks - l : 0;
+            if (e->start >= 0) {
+                for (int b = e->start + keep; b < e->start + e->len; b++)
+                    free_block(fs, b);
+            }
+            e->len = keep;
+        }
+        l += e->len;
+        if (e->len == 0) break;
+    }
+    for (int j = i + 1; j < ino->next_ext; j++) {
+        struct extent *e = &ino->ext[j];
+        if (e->start >= 0) {
+            for (int b = e->start; b < e->start + e->len; b++)
+                free_block(fs, b);
+        }
+    }
+    if (i < ino->next_ext)
+        ino->next_ext = i;
+
+    __atomic_store_n(&ino->ext_hint, 0, __ATOMIC_RELAXED);
+    ino->ext_dirty = 1;
+    return 0;
+}
+
+//adds extent to the end of the in-memory list, merging it with the last one when adjacent
+int ext_append(struct inode *ino, int start, int len) {
+    if (ino->next_ext > 0) {
+        struct extent *last = &ino->ext[ino->next_ext - 1];
+        if ((start < 0 && last->start < 0)
+                || (start >= 0 && last->start >= 0 && last->start + last->len == start)) {
+            last->len += len;
+            return 0;
+        }
+    }
+    if (ino->next_ext == ino->ext_cap) {
+        int cap = ino->ext_cap ? 2 * ino->ext_cap : 2 * FILE_EXTENTS;
+        struct extent *ext = realloc(ino->ext, cap * sizeof(struct extent));
+        if (ext == NULL)
+            return -1;
+        ino->ext = ext;
+        ino->ext_cap = cap;
+    }
+    ino->ext[ino->next_ext].start = start;
+    ino->ext[ino->next_ext].len = len;
+    ino->next_ext++;
+    return 0;
+}
+
+//maps len blocks of the hole at logical block lblock to blocks starting from start
+int ext_fill(struct inode *ino, int lblock, int start, int len) {
+    int l = 0;
+    int i;
+    for (i = 0; l + ino->ext[i].len <= lblock; i++)
+        l += ino->ext[i].len;
+
+    //the hole is split in place by appending its pieces and everything after it again
+    int before = lblock - l;
+    int after = ino->ext[i].len - before - len;
+    int ntail = ino->next_ext - i - 1;
+    struct extent *tail = malloc((ntail + 1) * sizeof(struct extent));
+    memcpy(tail, ino->ext + i + 1, ntail * sizeof(struct extent));
+    ino->next_ext = i;
+
+    int err = 0;
+    if (before > 0 && ext_append(ino, -1, before) < 0)
+        err = -1;
+    if (ext_append(ino, start, len) < 0)
+        err = -1;
+    if (after > 0 && ext_append(ino, -1, after) < 0)
+        err = -1;
+    for (int j = 0; j < ntail; j++) {
+        if (ext_append(ino, tail[j].start, tail[j].len) < 0)
+            err = -1;
+    }
+    free(tail);
+    __atomic_store_n(&ino->ext_hint, 0, __ATOMIC_RELAXED);
+    return err;
+}
+
+int load_extents(struct vsfs *fs, struct inode *ino) {
+    struct fstat *stat = &ino->stat;
+    for (int i = 0; i < FILE_EXTENTS && stat->extents[i].len > 0; i++) {
+        if (ext_append(ino, stat->extents[i].start, stat->extents[i].len) < 0)
+            return -READ_ERR;
+    }
+
+    if (ino->next_ext < FILE_EXTENTS || stat->ext_block < 0)
+        return 0;
+
+    int err = 0;
+    int blockid = stat->ext_block;
+    pthread_mutex_lock(&fs->buf_lock);
+    while (blockid >= 0 && err == 0) {
+        struct buf *b = buf_get(fs, blockid, 1);
+        if (b == NULL) {
+            err = -READ_ERR;
+            break;
+        }
+        b->meta = 1;
+        struct ext_block_header *eh = (struct ext_block_header *)b->data;
+        struct extent *ext = (struct extent *)(b->data + sizeof(struct ext_block_header));
+
+        ino->chain = realloc(ino->chain, (ino->nchain + 1) * sizeof(int));
+        ino->chain[ino->nchain++] = blockid;
+        for (int i = 0; i < eh->count && err == 0; i++) {
+            if (ext_append(ino, ext[i].start, ext[i].len) < 0)
+                err = -READ_ERR;
+        }
+        blockid = eh->next;
+    }
+    pthread_mutex_unlock(&fs->buf_lock);
+    return err;
+}
+
+//writes extents back to the fstat and extent chain, growing or shrinking the chain as needed
+int store_extents(struct vsfs *fs, struct inode *ino) {
+    struct fstat *stat = &ino->stat;
+    int per_block = (fs->h.block_size - sizeof(struct ext_block_header)) / sizeof(struct extent);
+    int rem = ino->next_ext > FILE_EXTENTS ? ino->next_ext - FILE_EXTENTS : 0;
+    int nchain = (rem + per_block - 1) / per_block;
+
+    if (nchain > ino->nchain) {
+        ino->chain = realloc(ino->chain, nchain * sizeof(int));
+        while (ino->nchain < nchain) {
+            int blockid = occupy_next_block(fs);
+            if (blockid < 0)
+                return -EOF_ERR;
+            ino->chain[ino->nchain++] = blockid;
+        }
+    }
+    while (ino->nchain > nchain)
+        free_block(fs, ino->chain[--ino->nchain]);
+
+    for (int i = 0; i < FILE_EXTENTS; i++) {
+        if (i < ino->next_ext) {
+            stat->extents[i] = ino->ext[i];
+        } else {
+            stat->extents[i].start = -1;
+            stat->extents[i].len = 0;
+        }
+    }
+    stat->ext_block = nchain > 0 ? ino->chain[0] : -1;
+
+    pthread_mutex_lock(&fs->buf_lock);
+    for (int c = 0; c < nchain; c++) {
+        struct buf *b = buf_get(fs, ino->chain[c], 0);
+        if (b == NULL) {
+            pthread_mutex_unlock(&fs->buf_lock);
+            return -WRITE_ERR;
+        }
+        struct ext_block_header *eh = (struct ext_block_header *)b->data;
+        memset(b->data, 0, fs->h.block_size);
+        eh->next = c + 1 < nchain ? ino->chain[c + 1] : -1;
+        eh->count = rem - c * per_block < per_block ? rem - c * per_block : per_block;
+        memcpy(b->data + sizeof(struct ext_block_header),
+               ino->ext + FILE_EXTENTS + c * per_block,
+               eh->count * sizeof(struct extent));
+        b->dirty = 1;
+        b->meta = 1;
+    }
+    pthread_mutex_unlock(&fs->buf_lock);
+
+    ino->ext_dirty = 0;
+    ino->dirty = 1;
+    return 0;
+}
+
+uint32_t crc32(const void *data, int len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+
+    const unsigned char *p = data;
+    uint32_t crc = 0xffffffff;
+    for (int i = 0; i < len; i++)
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+}
+
+//reads the journal header and replays transactions left by an unclean umount
+int journal_load(struct vsfs *fs) {
+    struct journal_header jh;
+    if (dev_read(fs, &jh, sizeof(jh), fs->jstart) < (int)sizeof(jh))
+        return -READ_ERR;
+    if (memcmp(jh.magic, journal_magic, sizeof(jh.magic)) != 0 || jh.size < JOURNAL_MIN_SIZE)
+        return -MARKER_ERR;
+
+    fs->jsize = jh.size;
+    fs->jseq = jh.seq;
+    fs->jhead = journal_align(fs, 0);
+    if (journal_replay(fs) < 0)
+        return -WRITE_ERR;
+    return 0;
+}
+
+/*
+  Reads transaction at byte pos of the log, returns its records or NULL if
+  there is no valid transaction with sequence number seq there. A torn
+  write of the last transaction is caught by the checksum.
+*/
+char *journal_read_txn(struct vsfs *fs, int pos, int seq, struct journal_txn *txn) {
+    int cap = fs->jsize - sizeof(struct journal_header);
+    off_t offset = fs->jstart + sizeof(struct journal_header) + pos;
+    if (cap - pos < (int)sizeof(struct journal_txn)
+            || dev_read(fs, txn, sizeof(struct journal_txn), offset) < (int)sizeof(struct journal_txn))
+        return NULL;
+    if (txn->magic != JTXN_MAGIC || txn->seq != seq
+            || txn->len < 0 || txn->len > cap - pos - (int)sizeof(struct journal_txn))
+        return NULL;
+
+    char *recs = malloc(txn->len);
+    if (dev_read(fs, recs, txn->len, offset + sizeof(struct journal_txn)) < txn->len
+            || crc32(recs, txn->len) != txn->crc) {
+        free(recs);
+        return NULL;
+    }
+    return recs;
+}
+
+//orders revoked pairs by block id
+int revoke_cmp(const void *a, const void *b) {
+    const int *x = a, *y = b;
+    return x[0] < y[0] ? -1 : x[0] > y[0];
+}
+
+/*
+  Replays committed transactions in order. Blocks freed by a transaction
+  may have been reused for file data written directly to the image, so the
+  first pass collects revoked blocks (pairs of block id and sequence number
+  of the last transaction freeing it) and older records of them are skipped.
+*/
+int journal_replay(struct vsfs *fs) {
+    struct journal_txn txn;
+    char *recs;
+    int *revoked = NULL;
+    int nrevoked = 0;
+    int pos = journal_align(fs, 0);
+    int seq = fs->jseq;
+    while ((recs = journal_read_txn(fs, pos, seq, &txn)) != NULL) {
+        for (int i = 0; i + (int)sizeof(struct journal_rec) <= txn.len; ) {
+            struct journal_rec *r = (struct journal_rec *)(recs + i);
+            i += sizeof(struct journal_rec) + ((r->len + 7) & ~7);
+            if (r->offset != JREC_REVOKE || i > txn.len)
+                continue;
+
+            int *ids = (int *)(r + 1);
+            int n = r->len / sizeof(int);
+            revoked = realloc(revoked, (nrevoked + n) * 2 * sizeof(int));
+            for (int k = 0; k < n; k++, nrevoked++) {
+                revoked[2 * nrevoked] = ids[k];
+                revoked[2 * nrevoked + 1] = seq;
+            }
+        }
+        free(recs);
+        pos = journal_align(fs, pos + sizeof(struct journal_txn) + txn.len);
+        seq++;
+    }
+    if (seq == fs->jseq)
+        return 0;
+
+    //only the last revocation of each block matters
+    qsort(revoked, nrevoked, 2 * sizeof(int), revoke_cmp);
+    int n = 0;
+    for (int i = 0; i < nrevoked; i++) {
+        if (n > 0 && revoked[2 * (n - 1)] == revoked[2 * i]) {
+            if (revoked[2 * i + 1] > revoked[2 * (n - 1) + 1])
+                revoked[2 * (n - 1) + 1] = revoked[2 * i + 1];
+            continue;
+        }
+        revoked[2 * n] = revoked[2 * i];
+        revoked[2 * n + 1] = revoked[2 * i + 1];
+        n++;
+    }
+
+    int err = 0;
+    pos = journal_align(fs, 0);
+    for (int s = fs->jseq; s < seq; s++) {
+        recs = journal_read_txn(fs, pos, s, &txn);
+        if (recs == NULL || journal_apply(fs, recs, txn.len, revoked, n, s) < 0)
+            err = -WRITE_ERR;
+        free(recs);
+        if (err < 0)
+            break;
+        pos = journal_align(fs, pos + sizeof(struct journal_txn) + txn.len);
+    }
+    free(revoked);
+    if (err < 0)
+        return err;
+
+    fs->jseq = seq;
+    return fs->rdonly ? 0 : journal_checkpoint(fs);
+}
+
+/*
+  Writes records of a transaction to their place in the image. Records of
+  data area blocks revoked by transaction seq or a later one are skipped
+  block by block.
+*/
+int journal_apply(struct vsfs *fs, char *recs, int len, int *revoked, int nrevoked, int seq) {
+    int bs = fs->h.block_size;
+    off_t blocks_offset = get_blocks_offset(fs);
+    for (int pos = 0; pos + (int)sizeof(struct journal_rec) <= len; ) {
+        struct journal_rec *r = (struct journal_rec *)(recs + pos);
+        pos += sizeof(struct journal_rec) + ((r->len + 7) & ~7);
+        if (r->offset == JREC_REVOKE)
+            continue;
+        if (pos > len || r->len < 0 || r->offset < 0 || r->offset + r->len > fs->jstart)
+            return -WRITE_ERR;
+
+        char *data = (char *)(r + 1);
+        if (r->offset < blocks_offset || nrevoked == 0) {
+            if (journal_put(fs, data, r->len, r->offset) < r->len)
+                return -WRITE_ERR;
+            continue;
+        }
+
+        for (int done = 0; done < r->len; done += bs) {
+            int key[2] = { (r->offset + done - blocks_offset) / bs, 0 };
+            int *rv = bsearch(key, revoked, nrevoked, 2 * sizeof(int), revoke_cmp);
+            if (rv != NULL && rv[1] >= seq)
+                continue;
+            int n = r->len - done < bs ? r->len - done : bs;
+            if (journal_put(fs, data + done, n, r->offset + done) < n)
+                return -WRITE_ERR;
+        }
+    }
+    return 0;
+}
+
+//in-place write of journal_apply, kept as a record of the overlay on a
+//read-only mount
+int journal_put(struct vsfs *fs, void *data, int len, off_t offset) {
+    if (!fs->rdonly)
+        return dev_write(fs, data, len, offset);
+
+    int need = fs->overlay_len + sizeof(struct journal_rec) + ((len + 7) & ~7);
+    if (need > fs->overlay_cap) {
+        int cap = fs->overlay_cap ? fs->overlay_cap : 4096;
+        while (cap < need)
+            cap *= 2;
+        char *overlay = realloc(fs->overlay, cap);
+        if (overlay == NULL)
+            return -1;
+        fs->overlay = overlay;
+        fs->overlay_cap = cap;
+    }
+
+    struct journal_rec *r = (struct journal_rec *)(fs->overlay + fs->overlay_len);
+    r->offset = offset;
+    r->len = len;
+    r->pad = 0;
+    memcpy(r + 1, data, len);
+    fs->overlay_len = need;
+    return len;
+}
+
+/*
+  Appends a record of the metadata write to the open transaction. Nothing
+  reaches the image until journal_commit.
+*/
+int journal_log(struct vsfs *fs, int64_t offset, void *data, int len) {
+    pthread_mutex_lock(&fs->jlock);
+    int need = sizeof(struct journal_txn) + fs->jlen + sizeof(struct journal_rec) + ((len + 7) & ~7);
+    if (need > fs->jcap) {
+        int cap = fs->jcap ? fs->jcap : 4096;
+        while (cap < need)
+            cap *= 2;
+        char *jbuf = realloc(fs->jbuf, cap);
+        if (jbuf == NULL) {
+            pthread_mutex_unlock(&fs->jlock);
+            return -WRITE_ERR;
+        }
+        fs->jbuf = jbuf;
+        fs->jcap = cap;
+    }
+
+    struct journal_rec *r = (struct journal_rec *)(fs->jbuf + sizeof(struct journal_txn) + fs->jlen);
+    r->offset = offset;
+    r->len = len;
+    r->pad = 0;
+    memcpy(r + 1, data, len);
+    memset((char *)(r + 1) + len, 0, ((len + 7) & ~7) - len);
+    fs->jlen += sizeof(struct journal_rec) + ((len + 7) & ~7);
+    pthread_mutex_unlock(&fs->jlock);
+    return 0;
+}
+
+/*
+  Called before every namespace or file change outside of a batch. Changes
+  are committed in groups: once the open transaction, with the dirty part
+  of the bitmap that is logged only at commit, takes a quarter of the
+  journal or blocks waiting for it outnumber the free ones.
+*/
+int journal_pending(struct vsfs *fs) {
+    if (!fs->journal || fs->batch)
+        return 0;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    int span = fs->bitmap_dirty_hi - fs->bitmap_dirty_lo;
+    if (span < 0)
+        span = 0;
+    else if (fs->aligned)
+        span = span / 8 + FORMAT_ALIGN;
+    pthread_mutex_lock(&fs->jlock);
+    int pending = fs->jlen + span > fs->jsize / 4 || fs->jnfree > fs->bitmap_nfree;
+    pthread_mutex_unlock(&fs->jlock);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return pending;
+}
+
+int journal_check(struct vsfs *fs) {
+    return journal_pending(fs) ? journal_commit(fs) : 0;
+}
+
+//journal_check for calls holding stripe key shared, it is dropped for the
+//time of the commit since the commit has to run alone
+int journal_check_shared(struct vsfs *fs, unsigned int key) {
+    if (!journal_pending(fs))
+        return 0;
+
+    ns_unlock_shared(fs, key);
+    ns_lock_all(fs);
+    int err = journal_check(fs);
+    ns_unlock_all(fs);
+    ns_lock_shared(fs, key);
+    return err;
+}
+
+/*
+  Commits all pending metadata changes: file data is written in place, the
+  transaction is appended to the log and synced in one go, then its records
+  are written to their place in the image. Those in-place writes are synced
+  only at the next checkpoint, replay repeats them after a crash. The
+  bitmap is logged once with the blocks taken by the transaction and once
+  more after the blocks it frees are released, so that a transaction
+  bigger than the whole log can be split (journal_commit_split).
+*/
+int journal_commit(struct vsfs *fs) {
+    if (flush_inodes(fs) < 0 || flush_dirtab(fs) < 0 || buf_flush(fs) < 0 || flush_bitmap(fs) < 0)
+        return -WRITE_ERR;
+
+    fs->jtaken = fs->jlen;
+    if (fs->jnfree > 0) {
+        aio_drain(fs);
+        for (int i = 0; i < fs->jnfree; i++) {
+            int blockid = fs->jfree[i];
+            uint64_t bit = (uint64_t)1 << (blockid % 64);
+            if (!(fs->bitmap[blockid / 64] & bit))
+                continue;
+            fs->bitmap[blockid / 64] &= ~bit;
+            fs->bitmap_nfree++;
+            mark_bitmap_dirty(fs, blockid);
+        }
+        if (journal_log(fs, JREC_REVOKE, fs->jfree, fs->jnfree * sizeof(int)) < 0)
+            return -WRITE_ERR;
+        fs->jnfree = 0;
+    }
+
+    if (flush_bitmap(fs) < 0)
+        return -WRITE_ERR;
+    if (fs->jlen == 0)
+        return 0;
+
+    int cap = fs->jsize - sizeof(struct journal_header);
+    int size = sizeof(struct journal_txn) + fs->jlen;
+    if (journal_align(fs, 0) + size > cap)
+        return journal_commit_split(fs);
+
+    if (journal_write_txn(fs, fs->jbuf, fs->jlen) < 0)
+        return -WRITE_ERR;
+    fs->jlen = 0;
+    return 0;
+}
+
+/*
+  Commits an open transaction bigger than the log as several transactions
+  that each fit into the empty log. Records are cut at multiples of the
+  block size or of FORMAT_ALIGN, whichever is smaller, so revocation still
+  works block by block. They are written in four passes: the bitmap with
+  the blocks taken, the other records, the bitmap with the blocks released
+  and the revocations, which so cover all the records before them. A crash
+  between two pieces can then only leave blocks marked in use that no file
+  has, vs_fsck frees them.
+*/
+int journal_commit_split(struct vsfs *fs) {
+    int cap = fs->jsize - sizeof(struct journal_header);
+    int room = (cap - journal_align(fs, 0) - (int)sizeof(struct journal_txn)) & ~7;
+    int unit = fs->h.block_size < FORMAT_ALIGN ? fs->h.block_size : FORMAT_ALIGN;
+    char *buf = malloc(sizeof(struct journal_txn) + room);
+    char *recs = fs->jbuf + sizeof(struct journal_txn);
+    int len = 0;
+    int err = 0;
+    for (int pass = 0; pass < 4 && err == 0; pass++) {
+        for (int pos = 0; pos < fs->jlen && err == 0; ) {
+            struct journal_rec *r = (struct journal_rec *)(recs + pos);
+            int bitmap = r->offset >= fs->bitmap_offset && r->offset < get_fstattab_offset(fs);
+            int which = r->offset == JREC_REVOKE ? 3 : !bitmap ? 1 : pos < fs->jtaken ? 0 : 2;
+            pos += sizeof(struct journal_rec) + ((r->len + 7) & ~7);
+            if (which != pass)
+                continue;
+
+            int revokes = pass == 3;
+            int step = revokes ? 8 : unit;
+            for (int done = 0; done < r->len && err == 0; ) {
+                int n = r->len - done;
+                int left = room - len - (int)sizeof(struct journal_rec);
+                if (n > left)
+                    n = left / step * step;
+                if (n <= 0) {
+                    err = journal_write_txn(fs, buf, len);
+                    len = 0;
+                    continue;
+                }
+
+                struct journal_rec *piece = (struct journal_rec *)(buf + sizeof(struct journal_txn) + len);
+                piece->offset = revokes ? JREC_REVOKE : r->offset + done;
+                piece->len = n;
+                piece->pad = 0;
+                memcpy(piece + 1, (char *)(r + 1) + done, n);
+                memset((char *)(piece + 1) + n, 0, ((n + 7) & ~7) - n);
+                len += sizeof(struct journal_rec) + ((n + 7) & ~7);
+                done += n;
+            }
+        }
+    }
+    if (err == 0 && len > 0)
+        err = journal_write_txn(fs, buf, len);
+    free(buf);
+    if (err < 0)
+        return -WRITE_ERR;
+    fs->jlen = 0;
+    return 0;
+}
+
+//appends the transaction in buf, len bytes of records after its header, to
+//the log, syncs it and writes the records in place
+int journal_write_txn(struct vsfs *fs, char *buf, int len) {
+    int cap = fs->jsize - sizeof(struct journal_header);
+    int size = sizeof(struct journal_txn) + len;
+    if (fs->jhead + size > cap && journal_checkpoint(fs) < 0)
+        return -WRITE_ERR;
+
+    char *recs = buf + sizeof(struct journal_txn);
+    struct journal_txn *txn = (struct journal_txn *)buf;
+    txn->magic = JTXN_MAGIC;
+    txn->seq = fs->jseq;
+    txn->len = len;
+    txn->crc = crc32(recs, len);
+    off_t offset = fs->jstart + sizeof(struct journal_header) + fs->jhead;
+    if (dev_write(fs, buf, size, offset) < size || dev_sync(fs) < 0)
+        return -WRITE_ERR;
+
+    if (journal_apply(fs, recs, len, NULL, 0, fs->jseq) < 0)
+        return -WRITE_ERR;
+    fs->jhead = journal_align(fs, fs->jhead + size);
+    fs->jseq++;
+    return 0;
+}
+
+//makes in-place writes of committed transactions durable and empties the log
+int journal_checkpoint(struct vsfs *fs) {
+    struct journal_header jh = {
+        .size = fs->jsize,
+        .seq = fs->jseq
+    };
+    memcpy(jh.magic, journal_magic, sizeof(jh.magic));
+    if (dev_sync(fs) < 0
+            || dev_write(fs, &jh, sizeof(jh), fs->jstart) < (int)sizeof(jh)
+            || dev_sync(fs) < 0)
+        return -WRITE_ERR;
+
+    fs->jhead = journal_align(fs, 0);
+    return 0;
+}
+
+//first byte of the log at or after pos where a transaction may start, in
+//version 3 images transactions start on a page so that committing one
+//never rewrites the page holding the end of the one before
+int journal_align(struct vsfs *fs, int pos) {
+    if (!fs->aligned)
+        return pos;
+    int hsize = sizeof(struct journal_header);
+    return ROUND_UP(hsize + pos, FORMAT_ALIGN) - hsize;
+}
+
+void journal_free(struct vsfs *fs) {
+    free(fs->jbuf);
+    free(fs->jfree);
+    free(fs->overlay);
+    fs->jbuf = NULL;
+    fs->jfree = NULL;
+    fs->overlay = NULL;
+    fs->jlen = fs->jcap = 0;
+    fs->jnfree = fs->jfree_cap = 0;
+}
+
+/*
+  Offline consistency check. The image is mounted first, so that committed
+  journal transactions are replayed as vs_mount would; without
+  VS_FSCK_REPAIR it is mounted read-only and the replay is only laid over
+  what is read (MOUNT_RDONLY). Directory records
+  are counted per inode, then the inode table is read in FSCK_CHUNK pieces,
+  the next one while threads check the current one: each takes a share of
+  its inodes, compares nlinks with the records and walks the blocks of the
+  file, marking them in seen (and in shared when they are marked already).
+  Last the bitmap is compared with seen and records of unused inodes are
+  looked for. Without VS_FSCK_REPAIR nothing is written; repairs go through
+  meta_write, so on journaled images they are committed as one transaction.
+  Returns 0 once the image is checked, whatever was found.
+*/
+int vs_fsck(char *filename, int flags, int nthreads, struct vs_fsck_report *report) {
+    struct vsfs *fs;
+    int err = vs_mount_ex(filename, flags & VS_FSCK_REPAIR ? 0 : MOUNT_RDONLY, &fs);
+    if (err < 0)
+        return err;
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > FSCK_MAX_THREADS)
+        nthreads = FSCK_MAX_THREADS;
+
+    struct fsck c;
+    memset(&c, 0, sizeof(c));
+    c.fs = fs;
+    c.repair = flags & VS_FSCK_REPAIR;
+    c.seen = calloc(fs->bitmap_nwords, sizeof(uint64_t));
+    c.shared = calloc(fs->bitmap_nwords, sizeof(uint64_t));
+    c.nrefs = calloc(fs->h.nfiles_max, sizeof(int));
+    c.nslots = fs->dir_nfree;
+    pthread_mutex_init(&c.lock, NULL);
+
+    for (int i = 0; i < fs->h.nfiles_max; i++) {
+        int id = fs->dirtab[i].id;
+        if (id >= 0 && id < fs->h.nfiles_max)
+            c.nrefs[id]++;
+    }
+
+    err = fsck_inodes(&c, nthreads);
+    if (err == 0) {
+        fsck_dirtab(&c);
+        fsck_bitmap(&c);
+        err = c.err;
+    }
+    if (err == 0 && c.repair && sync_image(fs) < 0)
+        err = -WRITE_ERR;
+    if (vs_umount(fs) < 0 && err == 0)
+        err = -WRITE_ERR;
+
+    *report = c.report;
+    report->repaired = c.repair && err == 0;
+    pthread_mutex_destroy(&c.lock);
+    free(c.seen);
+    free(c.shared);
+    free(c.nrefs);
+    free(c.orphans);
+    return err;
+}
+
+int fsck_inodes(struct fsck *c, int nthreads) {
+    struct vsfs *fs = c->fs;
+    int per_chunk = FSCK_CHUNK / sizeof(struct fstat);
+    off_t table = get_fstattab_offset(fs);
+    struct fstat *chunks[2] = {
+        malloc(per_chunk * sizeof(struct fstat)),
+        malloc(per_chunk * sizeof(struct fstat))
+    };
+    struct fsck_job jobs[FSCK_MAX_THREADS];
+
+    int err = 0;
+    int n = fs->h.nfiles_max < per_chunk ? fs->h.nfiles_max : per_chunk;
+    if (dev_read(fs, chunks[0], n * sizeof(struct fstat), table) < n * (int)sizeof(struct fstat))
+        err = -READ_ERR;
+
+    for (int first = 0, k = 0; first < fs->h.nfiles_max && err == 0; first += n, k ^= 1) {
+        n = fs->h.nfiles_max - first < per_chunk ? fs->h.nfiles_max - first : per_chunk;
+        for (int t = 0; t < nthreads; t++) {
+            jobs[t].c = c;
+            jobs[t].stats = chunks[k];
+            jobs[t].base = first;
+            jobs[t].first = first + (long long)n * t / nthreads;
+            jobs[t].n = first + (long long)n * (t + 1) / nthreads - jobs[t].first;
+            pthread_create(&jobs[t].thread, NULL, fsck_worker, &jobs[t]);
+        }
+
+        int next = first + n;
+        int nnext = fs->h.nfiles_max - next < per_chunk ? fs->h.nfiles_max - next : per_chunk;
+        if (nnext > 0 && dev_read(fs, chunks[k ^ 1], nnext * sizeof(struct fstat),
+                                  table + (off_t)next * sizeof(struct fstat)) < nnext * (int)sizeof(struct fstat))
+            err = -READ_ERR;
+
+        for (int t = 0; t < nthreads; t++)
+            pthread_join(jobs[t].thread, NULL);
+    }
+    free(chunks[0]);
+    free(chunks[1]);
+    return err < 0 ? err : c->err;
+}
+
+void *fsck_worker(void *arg) {
+    struct fsck_job *job = arg;
+    struct fsck *c = job->c;
+    struct vs_fsck_report r;
+    memset(&r, 0, sizeof(r));
+    char *block = malloc(c->fs->h.block_size);
+    for (int id = job->first; id < job->first + job->n; id++)
+        fsck_inode(c, id, &job->stats[id - job->base], block, &r);
+    free(block);
+
+    //all fields of the report are counters
+    pthread_mutex_lock(&c->lock);
+    int *dst = (int *)&c->report;
+    int *src = (int *)&r;
+    for (int i = 0; i < (int)(sizeof(r) / sizeof(int)); i++)
+        dst[i] += src[i];
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+//st is changed as it is to be repaired and written back if repairing
+void fsck_inode(struct fsck *c, int id, struct fstat *st, char *block, struct vs_fsck_report *r) {
+    struct vsfs *fs = c->fs;
+    if (st->nlinks <= 0) {
+        //records naming the unused inode are removed by fsck_dirtab
+        if (c->nrefs[id] > 0)
+            c->nrefs[id] = -1;
+        return;
+    }
+    r->files++;
+
+    int dirty = 0;
+    if (c->nrefs[id] == 0) {
+        r->orphans++;
+        pthread_mutex_lock(&c->lock);
+        if (c->repair && c->nslots > 0) {
+            c->nslots--;
+            c->orphans = realloc(c->orphans, (c->norphans + 1) * sizeof(int));
+            c->orphans[c->norphans++] = id;
+            st->nlinks = 1;
+            dirty = 1;
+        }
+        pthread_mutex_unlock(&c->lock);
+    } else if (st->nlinks != c->nrefs[id]) {
+        r->bad_nlinks++;
+        st->nlinks = c->nrefs[id];
+        dirty = 1;
+    }
+    if (st->size < 0) {
+        r->bad_sizes++;
+        st->size = 0;
+        dirty = 1;
+    }
+
+    int bs = fs->h.block_size;
+    int nblocks = st->size / bs + (st->size % bs != 0);
+    if (fs->version == FORMAT_BLOCKMAP)
+        dirty |= fsck_blockmap(c, st, nblocks, block, r);
+    else
+        dirty |= fsck_extents(c, st, nblocks, block, r);
+
+    if (dirty && c->repair && write_fstat(fs, st, id) < 0)
+        __atomic_store_n(&c->err, -WRITE_ERR, __ATOMIC_RELAXED);
+}
+
+//checks blocks_map and the indirect block, returns 1 if st was changed
+int fsck_blockmap(struct fsck *c, struct fstat *st, int nblocks, char *block, struct vs_fsck_report *r) {
+    struct vsfs *fs = c->fs;
+    int bs = fs->h.block_size;
+    int dirty = 0;
+    for (int j = 0; j < FILE_BLOCKS - 1; j++) {
+        if (st->blocks_map[j] >= 0 && fsck_ref(c, st->blocks_map[j], j, nblocks, r)) {
+            st->blocks_map[j] = -1;
+            dirty = 1;
+        }
+    }
+
+    int ind = st->blocks_map[FILE_BLOCKS - 1];
+    if (ind < 0)
+        return dirty;
+    if (ind >= fs->h.nblocks) {
+        r->bad_block_refs++;
+        st->blocks_map[FILE_BLOCKS - 1] = -1;
+        return 1;
+    }
+
+    off_t offset = get_blocks_offset(fs) + (off_t)ind * bs;
+    if (dev_read(fs, block, bs, offset) < bs) {
+        __atomic_store_n(&c->err, -READ_ERR, __ATOMIC_RELAXED);
+        return dirty;
+    }
+    int *blocks = (int *)block;
+    int used = 0;
+    int changed = 0;
+    for (int k = 0; k < bs / (int)sizeof(int); k++) {
+        if (blocks[k] < 0)
+            continue;
+        if (fsck_ref(c, blocks[k], FILE_BLOCKS - 1 + k, nblocks, r)) {
+            blocks[k] = -1;
+            changed = 1;
+        } else {
+            used = 1;
+        }
+    }
+
+    //indirect block of a file not reaching it goes with the blocks it mapped
+    if (!used && nblocks <= FILE_BLOCKS - 1) {
+        r->blocks_past_size++;
+        st->blocks_map[FILE_BLOCKS - 1] = -1;
+        return 1;
+    }
+    fsck_mark(c, ind);
+    if (changed && c->repair && meta_write(fs, block, bs, offset) < bs)
+        __atomic_store_n(&c->err, -WRITE_ERR, __ATOMIC_RELAXED);
+    return dirty;
+}
+
+//checks extents in the fstat and the extent chain, returns 1 if st was changed
+int fsck_extents(struct fsck *c, struct fstat *st, int nblocks, char *block, struct vs_fsck_report *r) {
+    struct vsfs *fs = c->fs;
+    int bs = fs->h.block_size;
+    int per_block = (bs - sizeof(struct ext_block_header)) / sizeof(struct extent);
+    long long lblock = 0;
+    int dirty = 0;
+    int n;
+    for (n = 0; n < FILE_EXTENTS && st->extents[n].len > 0; n++)
+        dirty |= fsck_extent(c, &st->extents[n], &lblock, nblocks, r);
+    if (n < FILE_EXTENTS || st->ext_block < 0)
+        return dirty;
+
+    int blockid = st->ext_block;
+    if (blockid >= fs->h.nblocks) {
+        r->bad_block_refs++;
+        st->ext_block = -1;
+        return 1;
+    }
+
+    //each extent takes a block at least, so a longer chain is broken (it may loop)
+    int max_chain = nblocks / per_block + 2;
+    for (int nchain = 1; blockid >= 0; nchain++) {
+        off_t offset = get_blocks_offset(fs) + (off_t)blockid * bs;
+        if (dev_read(fs, block, bs, offset) < bs) {
+            __atomic_store_n(&c->err, -READ_ERR, __ATOMIC_RELAXED);
+            break;
+        }
+        fsck_mark(c, blockid);
+
+        struct ext_block_header *eh = (struct ext_block_header *)block;
+        struct extent *ext = (struct extent *)(block + sizeof(struct ext_block_header));
+        int changed = 0;
+        if (eh->count < 0 || eh->count > per_block) {
+            r->bad_block_refs++;
+            eh->count = eh->count < 0 ? 0 : per_block;
+            changed = 1;
+        }
+        for (int i = 0; i < eh->count; i++)
+            changed |= fsck_extent(c, &ext[i], &lblock, nblocks, r);
+
+        if (eh->next >= fs->h.nblocks || (eh->next >= 0 && nchain >= max_chain)) {
+            r->bad_block_refs++;
+            eh->next = -1;
+            changed = 1;
+        }
+        blockid = eh->next;
+        if (changed && c->repair && meta_write(fs, block, bs, offset) < bs)
+            __atomic_store_n(&c->err, -WRITE_ERR, __ATOMIC_RELAXED);
+    }
+    return dirty;
+}
+
+//checks extent e at logical block *lblock and moves *lblock past it, returns 1
+//if e was changed: broken extents and those past size become holes, one
+//crossing the end of the file is cut there (later extents are all past it)
+int fsck_extent(struct fsck *c, struct extent *e, long long *lblock, int nblocks, struct vs_fsck_report *r) {
+    long long l = *lblock;
+    *lblock += e->len;
+    if (e->start < 0 || e->len <= 0)
+        return 0;
+
+    if ((long long)e->start + e->len > c->fs->h.nblocks) {
+        r->bad_block_refs++;
+        e->start = -1;
+        return 1;
+    }
+    if (l >= nblocks) {
+        r->blocks_past_size += e->len;
+        e->start = -1;
+        return 1;
+    }
+
+    int changed = 0;
+    if (l + e->len > nblocks) {
+        r->blocks_past_size += l + e->len - nblocks;
+        e->len = nblocks - l;
+        changed = 1;
+    }
+    for (int i = 0; i < e->len; i++)
+        fsck_mark(c, e->start + i);
+    return changed;
+}
+
+//checks block mapped at logical block lblock of a file of nblocks blocks,
+//returns 1 if it has to be unmapped
+int fsck_ref(struct fsck *c, int blockid, int lblock, int nblocks, struct vs_fsck_report *r) {
+    if (blockid >= c->fs->h.nblocks) {
+        r->bad_block_refs++;
+        return 1;
+    }
+    if (lblock >= nblocks) {
+        r->blocks_past_size++;
+        return 1;
+    }
+    fsck_mark(c, blockid);
+    return 0;
+}
+
+void fsck_mark(struct fsck *c, int blockid) {
+    uint64_t bit = (uint64_t)1 << (blockid % 64);
+    if (__atomic_fetch_or(&c->seen[blockid / 64], bit, __ATOMIC_RELAXED) & bit)
+        __atomic_fetch_or(&c->shared[blockid / 64], bit, __ATOMIC_RELAXED);
+}
+
+//removes records of unused and out of range inodes, links orphans
+void fsck_dirtab(struct fsck *c) {
+    struct vsfs *fs = c->fs;
+    for (int i = 0; i < fs->h.nfiles_max; i++) {
+        int id = fs->dirtab[i].id;
+        if (id < 0 || (id < fs->h.nfiles_max && c->nrefs[id] >= 0))
+            continue;
+
+        c->report.bad_dir_recs++;
+        if (!c->repair)
+            continue;
+        struct dir_rec empty = {
+            .id = -1
+        };
+        dir_index_remove(fs, i);
+        fs->dirtab[i] = empty;
+        dir_release_slot(fs, i);
+        if (write_dir_rec(fs, &empty, i) < 0)
+            c->err = -WRITE_ERR;
+    }
+
+    for (int k = 0; k < c->norphans; k++) {
+        struct dir_rec rec = {
+            .id = c->orphans[k]
+        };
+        snprintf(rec.name, MAX_NAMESIZE, "lost+found-%d", rec.id);
+        int slot = dir_alloc_slot(fs);
+        fs->dirtab[slot] = rec;
+        dir_index_insert(fs, slot);
+        if (write_dir_rec(fs, &rec, slot) < 0)
+            c->err = -WRITE_ERR;
+    }
+}
+
+//compares the bitmap with blocks seen, which it becomes on repair
+void fsck_bitmap(struct fsck *c) {
+    struct vsfs *fs = c->fs;
+    struct vs_fsck_report *r = &c->report;
+    for (int w = 0; w < fs->bitmap_nwords; w++) {
+        //bits past the last block are always set
+        uint64_t valid = ~(uint64_t)0;
+        if (w == fs->bitmap_nwords - 1 && fs->h.nblocks % 64 != 0)
+            valid = ((uint64_t)1 << (fs->h.nblocks % 64)) - 1;
+        uint64_t used = fs->bitmap[w] & valid;
+        uint64_t seen = c->seen[w];
+
+        r->blocks_used += __builtin_popcountll(seen);
+        r->shared_blocks += __builtin_popcountll(c->shared[w]);
+        r->leaked_blocks += __builtin_popcountll(used & ~seen);
+        r->lost_blocks += __builtin_popcountll(seen & ~used);
+        if (!c->repair || used == seen)
+            continue;
+
+        fs->bitmap[w] = seen | ~valid;
+        fs->bitmap_nfree += __builtin_popcountll(used) - __builtin_popcountll(seen);
+        mark_bitmap_dirty(fs, w * 64);
+        mark_bitmap_dirty(fs, w * 64 + 63 < fs->h.nblocks ? w * 64 + 63 : fs->h.nblocks - 1);
+    }
+}
+
+#ifdef VSFS_STATS
+void stats_begin(struct stats_probe *p) {
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+    p->syscalls = stats_syscalls;
+}
+
+void stats_end(struct vsfs *fs, struct stats_probe *p, int op, long bytes, int failed) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ns = (end.tv_sec - p->start.tv_sec) * 1000000000L + end.tv_nsec - p->start.tv_nsec;
+    int bucket = ns > 0 ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= VS_LAT_BUCKETS)
+        bucket = VS_LAT_BUCKETS - 1;
+
+    struct vs_op_stats *s = &fs->stats[op];
+    __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+    if (failed)
+        __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+    if (bytes > 0)
+        __atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+    if (stats_syscalls > p->syscalls)
+        __atomic_fetch_add(&s->syscalls, stats_syscalls - p->syscalls, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->lat[bucket], 1, __ATOMIC_RELAXED);
+}
+#endif
@@ -1,13 +1,58 @@
+#include <sys/types.h>
+
 #define FILE_BLOCKS 5
 #define MAX_NAMESIZE 28
 #define BLOCK_SIZE 256
+#define MAX_BLOCK_SIZE 65536
 #define MAX_FILES_OPENED 256
 
+//vs_mount_ex flags
+#define VS_MOUNT_MMAP 1
+
+//vs_seek whence
+#define VS_SEEK_SET 0
+#define VS_SEEK_CUR 1
+#define VS_SEEK_END 2
+
+//vs_aio_setup modes
+#define VS_AIO_URING 1
+#define VS_AIO_THREADS 2
+
+//vs_aio opcodes
+#define VS_AIO_READ 0
+#define VS_AIO_WRITE 1
+
+//vs_mkfs_opts flags: reserve space of the data area instead of leaving it sparse,
+//leave inode and directory tables zero instead of writing them out,
+//format without a metadata journal
+#define VS_MKFS_PREALLOC 1
+#define VS_MKFS_LAZY 2
+#define VS_MKFS_NOJOURNAL 4
+
+#define FILE_EXTENTS 2
+
+//smallest buffer cache accepted by vs_set_cache_size
+#define VS_CACHE_MIN_FRAMES 16
+
+//run of len physically contiguous blocks starting at block start
+struct extent {
+    int start;
+    int len;
+};
+
 struct fstat {
     int ftype;
     int nlinks;
     int size;
-    int blocks_map[FILE_BLOCKS];
+    union {
+        //format version 1: direct blocks, the last one is an indirect block
+        int blocks_map[FILE_BLOCKS];
+        //format version 2: first extents of the file and its extent block chain
+        struct {
+            struct extent extents[FILE_EXTENTS];
+            int ext_block;
+        };
+    };
 };
 
 struct dir_rec {
@@ -15,16 +60,156 @@ struct dir_rec {
     char name[MAX_NAMESIZE];
 };
 
+//vs_mkfs_ex options, zero fields take defaults
+struct vs_mkfs_opts {
+    int block_size;     //power of two from BLOCK_SIZE to MAX_BLOCK_SIZE
+    int flags;          //VS_MKFS_* flags
+    int journal_size;   //bytes, 1/16 of the image by default
+};
+
+//buffer cache counters, hits and misses are counted per block
+struct vs_cache_stats {
+    int nframes;
+    long hits;
+    long misses;
+    long evictions;
+    long writebacks;    //blocks written back to the image
+};
+
+//free space summary returned by vs_statfs
+struct vs_statfs {
+    int block_size;
+    int blocks;
+    int blocks_free;
+    int files;          //inodes
+    int files_free;
+    int names_free;     //unused directory records, each file and link takes one
+};
+
+//asynchronous vs_read or vs_write, owned by the library from vs_aio_submit
+//until vs_aio_poll or vs_aio_wait hands it back
+struct vs_aio {
+    int opcode;         //VS_AIO_READ or VS_AIO_WRITE
+    int fd;
+    int offset;
+    int size;
+    char *buffer;
+    void (*callback)(struct vs_aio *req);   //called by vs_aio_poll and vs_aio_wait if set
+    void *data;         //left to the caller
+    int result;         //what vs_read or vs_write would return
+
+    //used by the library while the request is in flight
+    int npending;
+    struct vs_aio *next;
+};
+
+//operations counted by vs_get_stats, the library counts them only when built
+//with VSFS_STATS defined (make STATS=1). Reads and writes include sequential ones.
+//The directory table is read once, at mount, and kept in memory; fstat writes
+//are counted per run of consecutive inodes written back together
+#define VS_OP_OPEN 0
+#define VS_OP_READ 1
+#define VS_OP_WRITE 2
+#define VS_OP_CREATE 3
+#define VS_OP_UNLINK 4
+#define VS_OP_TRUNCATE 5
+#define VS_OP_LINK 6
+#define VS_OP_READDIR 7
+#define VS_OP_GET_BLOCK_ID 8
+#define VS_OP_OCCUPY_NEXT_BLOCK 9
+#define VS_OP_READ_DIRTAB 10
+#define VS_OP_WRITE_FSTAT 11
+#define VS_NOPS 12
+
+//latency histogram buckets, bucket i counts calls taking less than 2^i ns
+//(and at least 2^(i-1) ns), the last one also all longer calls
+#define VS_LAT_BUCKETS 32
+
+//counters of one operation, an operation running inside another one (get_block_id
+//inside vs_write) is counted in both
+struct vs_op_stats {
+    long calls;
+    long errors;        //calls returning an error
+    long bytes;         //read or written by the caller
+    long syscalls;      //image I/O calls made while running
+    long ns;            //total time spent
+    long lat[VS_LAT_BUCKETS];
+};
+
+//returned by vs_get_stats, all zero when counting was not built in
+struct vs_stats {
+    int enabled;
+    struct vs_op_stats ops[VS_NOPS];
+};
+
+//vs_fsck flags
+#define VS_FSCK_REPAIR 1
+
+//problems found by vs_fsck, each block, inode or record is counted once
+struct vs_fsck_report {
+    int files;              //inodes in use
+    int blocks_used;        //blocks used by files, indirect and extent blocks included
+    int leaked_blocks;      //occupied in the bitmap, used by no file
+    int lost_blocks;        //used by a file, free in the bitmap
+    int shared_blocks;      //used more than once, not repaired
+    int bad_block_refs;     //block ids past the data area, turned into holes
+    int blocks_past_size;   //mapped past the end of the file, unmapped
+    int bad_sizes;          //negative sizes, set to 0
+    int bad_nlinks;         //nlinks not matching the directory records of the file
+    int orphans;            //inodes in use without directory records, linked as lost+found-<id>
+    int bad_dir_recs;       //records of unused or out of range inodes, removed
+    int repaired;           //1 if the problems were written back
+};
+
+//vs_defrag flags
+#define VS_DEFRAG_COMPACT 1
+
+//fragmentation counted by vs_fragstat and vs_defrag: data blocks of files and
+//the runs of physically contiguous blocks holding them in logical order, holes
+//skipped, so a file in a single run is read with one seek
+struct vs_frag {
+    int files;          //files with data blocks
+    int fragmented;     //files in more than one run
+    int blocks;
+    int runs;
+};
+
+//mounted image, all calls below operate on the image passed as fs and may be
+//made from several threads at once, except vs_umount which has to be the last one
+struct vsfs;
+
 int vs_mkfs(char *filename, int dev_size);
-int vs_mount(char *filename);
-int vs_umount();
-int vs_getstat(int id, struct fstat *stat);
-int vs_readdir(struct dir_rec *dir_rec, int next);
-int vs_create(char *pathname);
-int vs_open(char *pathname);
-int vs_close(int fd);
-int vs_read(int fd, int offset, int size, char *buffer);
-int vs_write(int fd, int offset, int size, char *buffer);
-int vs_link(char *src_pathname, char *dest_pathname);
-int vs_unlink(char *pathname);
-int vs_truncate(char *pathname, int size);
\ No newline at end of file
+int vs_mkfs_ex(char *filename, off_t dev_size, struct vs_mkfs_opts *opts);
+int vs_fsck(char *filename, int flags, int nthreads, struct vs_fsck_report *report);
+int vs_mount(char *filename, struct vsfs **fs);
+int vs_mount_ex(char *filename, int flags, struct vsfs **fs);
+int vs_umount(struct vsfs *fs);
+int vs_sync(struct vsfs *fs);
+int vs_statfs(struct vsfs *fs, struct vs_statfs *st);
+int vs_batch_begin(struct vsfs *fs);
+int vs_batch_commit(struct vsfs *fs);
+int vs_set_cache_size(struct vsfs *fs, int nframes);
+int vs_get_cache_stats(struct vsfs *fs, struct vs_cache_stats *stats);
+int vs_get_stats(struct vsfs *fs, struct vs_stats *stats);
+int vs_reset_stats(struct vsfs *fs);
+int vs_getstat(struct vsfs *fs, int id, struct fstat *stat);
+int vs_readdir(struct vsfs *fs, struct dir_rec *dir_rec, int *cursor);
+int vs_create(struct vsfs *fs, char *pathname);
+int vs_lookup(struct vsfs *fs, char *pathname);
+int vs_open(struct vsfs *fs, char *pathname);
+int vs_close(struct vsfs *fs, int fd);
+int vs_read(struct vsfs *fs, int fd, int offset, int size, char *buffer);
+int vs_write(struct vsfs *fs, int fd, int offset, int size, char *buffer);
+int vs_seq_read(struct vsfs *fs, int fd, int size, char *buffer);
+int vs_seq_write(struct vsfs *fs, int fd, int size, char *buffer);
+int vs_seek(struct vsfs *fs, int fd, int offset, int whence);
+int vs_aio_setup(struct vsfs *fs, int mode);
+int vs_aio_submit(struct vsfs *fs, struct vs_aio **reqs, int nreqs);
+int vs_aio_poll(struct vsfs *fs, struct vs_aio **done, int max);
+int vs_aio_wait(struct vsfs *fs, struct vs_aio **done, int min, int max);
+int vs_aio_event_fd(struct vsfs *fs);
+int vs_link(struct vsfs *fs, char *src_pathname, char *dest_pathname);
+int vs_unlink(struct vsfs *fs, char *pathname);
+int vs_truncate(struct vsfs *fs, char *pathname, int size);
+int vs_fragstat(struct vsfs *fs, char *pathname, struct vs_frag *frag);
+int vs_defrag(struct vsfs *fs, char *pathname, int flags, struct vs_frag *frag);
\ No newline at end of file